@@ -0,0 +1,272 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <ostream>
+#include <iomanip>
+#include "SpinWait.h"
+
+//  Spin-then-park mutex with an optional contention profiler
+//  Lockable, so it drops into std::lock_guard / std::unique_lock in place of std::mutex
+//
+//  Critical sections in this project range from a few ns (deposit) to seconds (withdraw)
+//  A short spin catches the first kind without a syscall, exponential backoff keeps the
+//  spinners off the lock's cache line, and parking in the kernel covers the second kind.
+//  The spin budget adapts per lock to what recent acquisitions actually needed.
+
+//  Profiler
+
+#define LOCK_STRINGIZE2(x) #x
+#define LOCK_STRINGIZE(x) LOCK_STRINGIZE2(x)
+//  Call site tag for adaptiveMutex::lock(site) and siteLockGuard
+#define LOCK_SITE __FILE__ ":" LOCK_STRINGIZE(__LINE__)
+
+//  Aggregated timings of one lock, all times in ns
+class lockStats
+{
+public:
+
+	struct counters
+	{
+		uint64_t acquisitions = 0;
+		uint64_t contended = 0;     //  could not take the lock on the first try
+		uint64_t waitTotal = 0;
+		uint64_t waitMax = 0;
+		uint64_t holdTotal = 0;
+		uint64_t holdMax = 0;
+
+		void add(const bool wasContended, const uint64_t wait, const uint64_t hold)
+		{
+			++acquisitions;
+			if (wasContended) ++contended;
+			waitTotal += wait;
+			waitMax = std::max(waitMax, wait);
+			holdTotal += hold;
+			holdMax = std::max(holdMax, hold);
+		}
+	};
+
+	const std::string                       myName;
+	mutable std::mutex                      myMutex;
+	counters                                myTotals;
+	std::map<std::string, counters>         mySites;
+
+	explicit lockStats(const std::string& name) : myName(name) {}
+
+	void record(const char* site, const bool contended, const uint64_t wait, const uint64_t hold)
+	{
+		std::lock_guard<std::mutex> lk(myMutex);
+		myTotals.add(contended, wait, hold);
+		mySites[site ? site : "(unknown)"].add(contended, wait, hold);
+	}
+};
+
+//  Registry of profiled locks, one instance per process
+//  Recording is off until enable(), profiled locks then cost two clock reads per acquisition
+class lockProfiler
+{
+	std::mutex                                  myMutex;
+	std::vector<std::unique_ptr<lockStats>>     myLocks;
+	std::atomic<bool>                           myEnabled;
+
+	lockProfiler() : myEnabled(false) {}
+
+public:
+
+	static lockProfiler* getInstance()
+	{
+		static lockProfiler instance;
+		return &instance;
+	}
+
+	void enable(const bool on = true) { myEnabled.store(on, std::memory_order_relaxed); }
+	bool enabled() const { return myEnabled.load(std::memory_order_relaxed); }
+
+	//  Stats live as long as the process, so locks can come and go
+	lockStats* registerLock(const std::string& name)
+	{
+		std::lock_guard<std::mutex> lk(myMutex);
+		myLocks.push_back(std::unique_ptr<lockStats>(new lockStats(name)));
+		return myLocks.back().get();
+	}
+
+	//  Locks by total wait time, worst first, with their call sites
+	void report(std::ostream& os)
+	{
+		std::vector<std::pair<lockStats::counters, const lockStats*>> rows;
+		{
+			std::lock_guard<std::mutex> lk(myMutex);
+			for (const auto& l : myLocks)
+			{
+				std::lock_guard<std::mutex> lk2(l->myMutex);
+				rows.push_back(std::make_pair(l->myTotals, l.get()));
+			}
+		}
+		std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) { return a.first.waitTotal > b.first.waitTotal; });
+
+		os << std::left << std::setw(24) << "lock" << std::right
+			<< std::setw(12) << "acquired" << std::setw(12) << "contended"
+			<< std::setw(14) << "wait ms" << std::setw(14) << "max wait us"
+			<< std::setw(14) << "hold ms" << std::setw(14) << "max hold us" << "\n";
+		for (const auto& r : rows)
+		{
+			const lockStats::counters& c = r.first;
+			os << std::left << std::setw(24) << r.second->myName << std::right
+				<< std::setw(12) << c.acquisitions << std::setw(12) << c.contended
+				<< std::setw(14) << c.waitTotal / 1e6 << std::setw(14) << c.waitMax / 1e3
+				<< std::setw(14) << c.holdTotal / 1e6 << std::setw(14) << c.holdMax / 1e3 << "\n";
+
+			std::lock_guard<std::mutex> lk(r.second->myMutex);
+			for (const auto& s : r.second->mySites)
+			{
+				os << "    " << s.first << ": " << s.second.acquisitions << " acquired, "
+					<< s.second.waitTotal / 1e6 << " ms wait, " << s.second.holdTotal / 1e6 << " ms hold\n";
+			}
+		}
+	}
+};
+
+//  Mutex
+
+class adaptiveMutex
+{
+	//  Drepper's three state futex mutex
+	static constexpr uint32_t unlocked = 0;
+	static constexpr uint32_t locked = 1;
+	static constexpr uint32_t contended = 2;   //  locked, and someone may be parked
+
+	//  Longest single backoff, in pause instructions
+	static constexpr uint32_t maxBackoff = 64;
+
+	std::atomic<uint32_t>   myState;
+	spinBudget              myBudget;
+	lockStats*              myStats;
+
+	//  Profiling of the current hold, only touched by the owner
+	typedef std::chrono::steady_clock clock;
+	bool                    myTiming;
+	bool                    myContended;
+	const char*             mySite;
+	clock::time_point       myAcquired;
+	uint64_t                myWait;
+
+	//  Returns false if the lock was not free on the first try
+	bool acquire()
+	{
+		uint32_t c = unlocked;
+		if (myState.compare_exchange_strong(c, locked, std::memory_order_acquire)) return true;
+
+		//  Spin with exponential backoff, testing before each attempt so the
+		//  cache line stays shared until it is likely to be free
+		const uint32_t limit = myBudget.limit();
+		uint32_t spins = 0;
+		for (uint32_t backoff = 1; spins < limit; backoff = std::min(backoff * 2, maxBackoff))
+		{
+			for (uint32_t i = 0; i < backoff; ++i) cpuRelax();
+			spins += backoff;
+			if (myState.load(std::memory_order_relaxed) == unlocked)
+			{
+				c = unlocked;
+				if (myState.compare_exchange_strong(c, locked, std::memory_order_acquire))
+				{
+					myBudget.succeeded(spins);
+					return false;
+				}
+			}
+		}
+
+		//  Park, marking the lock contended so that unlock() wakes us
+		myBudget.parked();
+		c = myState.exchange(contended, std::memory_order_acquire);
+		while (c != unlocked)
+		{
+			futexWait(myState, contended);
+			c = myState.exchange(contended, std::memory_order_acquire);
+		}
+		return false;
+	}
+
+public:
+
+	//  Unprofiled
+	adaptiveMutex() : myState(unlocked), myStats(nullptr), myTiming(false), myContended(false), mySite(nullptr), myWait(0) {}
+
+	//  Profiled under name, once lockProfiler::getInstance()->enable() is called
+	explicit adaptiveMutex(const std::string& name) : adaptiveMutex()
+	{
+		myStats = lockProfiler::getInstance()->registerLock(name);
+	}
+
+	//  Non copyable, non movable, as std::mutex
+	adaptiveMutex(const adaptiveMutex&) = delete;
+	adaptiveMutex& operator=(const adaptiveMutex&) = delete;
+
+	void lock() { lock(nullptr); }
+
+	//  site is a string literal, usually LOCK_SITE
+	void lock(const char* site)
+	{
+		if (!myStats || !lockProfiler::getInstance()->enabled())
+		{
+			acquire();
+			return;
+		}
+
+		const clock::time_point t0 = clock::now();
+		const bool first = acquire();
+		myAcquired = clock::now();
+		myWait = std::chrono::duration_cast<std::chrono::nanoseconds>(myAcquired - t0).count();
+		myContended = !first;
+		mySite = site;
+		myTiming = true;
+	}
+
+	bool try_lock()
+	{
+		uint32_t c = unlocked;
+		return myState.compare_exchange_strong(c, locked, std::memory_order_acquire);
+	}
+
+	void unlock()
+	{
+		//  Copy out the owner's profiling fields before anyone else can take the lock
+		const bool timing = myTiming;
+		myTiming = false;
+		const bool wasContended = myContended;
+		const char* site = mySite;
+		const uint64_t wait = myWait;
+		const clock::time_point acquired = myAcquired;
+		const clock::time_point released = timing ? clock::now() : acquired;
+
+		if (myState.exchange(unlocked, std::memory_order_release) == contended) futexWakeOne(myState);
+
+		if (timing)
+		{
+			const uint64_t hold = std::chrono::duration_cast<std::chrono::nanoseconds>(released - acquired).count();
+			myStats->record(site, wasContended, wait, hold);
+		}
+	}
+};
+
+//  lock_guard that tags the acquisition with its call site
+//      siteLockGuard<adaptiveMutex> lg(myMutex, LOCK_SITE);
+template <class M>
+class siteLockGuard
+{
+	M& myMutex;
+
+public:
+
+	siteLockGuard(M& m, const char* site) : myMutex(m) { myMutex.lock(site); }
+	~siteLockGuard() { myMutex.unlock(); }
+
+	siteLockGuard(const siteLockGuard&) = delete;
+	siteLockGuard& operator=(const siteLockGuard&) = delete;
+};
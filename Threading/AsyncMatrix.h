@@ -0,0 +1,234 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <exception>
+#include <optional>
+#include <atomic>
+#include <tuple>
+#include <vector>
+#include <type_traits>
+#include "matrix.h"
+#include "ThreadPool.h"
+
+//  Futures with continuations on the shared ThreadPool
+//
+//  std::future can only be waited on, so chaining products through it blocks a thread
+//  per edge. Here a result carries a list of continuations instead: when it is set,
+//  each dependent task is pushed onto the pool, and nothing waits in between.
+//  C = A*B; D = transpose(C)*E becomes a DAG that only the final get() blocks on.
+
+template <class T> class asyncFuture;
+
+//  Stands for the value of an asyncFuture<void>, so the state below needs no specialization
+struct asyncVoid {};
+
+template <class T>
+using asyncStored = std::conditional_t<std::is_void<T>::value, asyncVoid, T>;
+
+//  Result of a continuation f on an asyncFuture<T>, f(const T&), or f() when T is void
+template <class F, class T>
+struct continuationResult { typedef std::decay_t<decltype(std::declval<const F&>()(std::declval<const T&>()))> type; };
+template <class F>
+struct continuationResult<F, void> { typedef std::decay_t<decltype(std::declval<const F&>()())> type; };
+
+template <class R, class F, class T>
+asyncStored<R> invokeContinuation(const F& f, const asyncStored<T>& value)
+{
+	if constexpr (std::is_void<T>::value && std::is_void<R>::value) { f(); return asyncVoid(); }
+	else if constexpr (std::is_void<T>::value) return f();
+	else if constexpr (std::is_void<R>::value) { f(value); return asyncVoid(); }
+	else return f(value);
+}
+
+//  Shared state between the producing task and the futures
+//  asyncState<void> holds an asyncVoid
+//  Threads blocked in get() sleep in ThreadPool::helpUntil, woken once the state is set
+template <class T>
+class asyncState
+{
+public:
+	std::mutex                          myMutex;
+	bool                                myReady;
+	std::optional<asyncStored<T>>       myValue;
+	std::exception_ptr                  myError;
+	std::vector<std::function<void()>>  myContinuations;
+
+	asyncState() : myReady(false) {}
+
+	void setValue(asyncStored<T> value)
+	{
+		std::vector<std::function<void()>> conts;
+		{
+			std::lock_guard<std::mutex> lk(myMutex);
+			myValue.emplace(std::move(value));
+			myReady = true;
+			conts.swap(myContinuations);
+		}	//	Unlock before notification
+		ThreadPool::getInstance()->notifyHelpers();
+		for (auto& c : conts) c();
+	}
+
+	void setError(std::exception_ptr error)
+	{
+		std::vector<std::function<void()>> conts;
+		{
+			std::lock_guard<std::mutex> lk(myMutex);
+			myError = error;
+			myReady = true;
+			conts.swap(myContinuations);
+		}
+		ThreadPool::getInstance()->notifyHelpers();
+		for (auto& c : conts) c();
+	}
+
+	//  Runs c immediately if already set, otherwise on the thread that sets it
+	//  Continuations must be cheap, typically they only spawn a task
+	void addContinuation(std::function<void()> c)
+	{
+		{
+			std::unique_lock<std::mutex> lk(myMutex);
+			if (!myReady)
+			{
+				myContinuations.push_back(std::move(c));
+				return;
+			}
+		}
+		c();
+	}
+};
+
+template <class T>
+class asyncFuture
+{
+	template <class U> friend class asyncFuture;
+	template <class... Ts> friend asyncFuture<std::tuple<asyncFuture<Ts>...>> when_all(const asyncFuture<Ts>&... fs);
+
+	std::shared_ptr<asyncState<T>> myState;
+
+public:
+
+	asyncFuture() : myState(std::make_shared<asyncState<T>>()) {}
+	explicit asyncFuture(std::shared_ptr<asyncState<T>> state) : myState(std::move(state)) {}
+
+	bool ready() const
+	{
+		std::lock_guard<std::mutex> lk(myState->myMutex);
+		return myState->myReady;
+	}
+
+	//  Blocks until set, rethrows the task's exception
+	//  While waiting, the caller executes queued pool tasks, see ThreadPool::helpUntil,
+	//  so get() also completes with an empty pool or from inside a pool task
+	//  Returns nothing on an asyncFuture<void>
+	std::conditional_t<std::is_void<T>::value, void, const asyncStored<T>&> get() const
+	{
+		ThreadPool::getInstance()->helpUntil([this] { return ready(); });
+		//  Set once and for all, no lock needed from here
+		if (myState->myError) std::rethrow_exception(myState->myError);
+		if constexpr (!std::is_void<T>::value) return *myState->myValue;
+	}
+
+	//  Schedule f(value) on the pool once this is set, without blocking
+	//  f() after an asyncFuture<void>, and f may return void
+	//  Errors skip f and propagate down the chain
+	template <class F>
+	auto then(F f) const -> asyncFuture<typename continuationResult<F, T>::type>
+	{
+		typedef typename continuationResult<F, T>::type R;
+		asyncFuture<R> res;
+		std::shared_ptr<asyncState<T>> src = myState;
+		std::shared_ptr<asyncState<R>> dst = res.myState;
+
+		myState->addContinuation([src, dst, f]()
+		{
+			ThreadPool::getInstance()->spawnTask([src, dst, f]()
+			{
+				if (src->myError) dst->setError(src->myError);
+				else
+				{
+					try
+					{
+						dst->setValue(invokeContinuation<R, F, T>(f, *src->myValue));
+					}
+					catch (...)
+					{
+						dst->setError(std::current_exception());
+					}
+				}
+				return true;
+			});
+		});
+
+		return res;
+	}
+};
+
+template <class T>
+asyncFuture<std::decay_t<T>> makeReadyFuture(T&& value)
+{
+	std::shared_ptr<asyncState<std::decay_t<T>>> state = std::make_shared<asyncState<std::decay_t<T>>>();
+	state->setValue(std::forward<T>(value));
+	return asyncFuture<std::decay_t<T>>(state);
+}
+
+//  Future that is set once all inputs are set, holding the (ready) input futures
+//  Inputs are not copied, continuations read them with get()
+template <class... Ts>
+asyncFuture<std::tuple<asyncFuture<Ts>...>> when_all(const asyncFuture<Ts>&... fs)
+{
+	typedef std::tuple<asyncFuture<Ts>...> R;
+	std::shared_ptr<asyncState<R>> dst = std::make_shared<asyncState<R>>();
+
+	if constexpr (sizeof...(Ts) == 0) dst->setValue(R());
+	else
+	{
+		std::shared_ptr<R> all = std::make_shared<R>(fs...);
+		std::shared_ptr<std::atomic<size_t>> count = std::make_shared<std::atomic<size_t>>(sizeof...(Ts));
+		std::function<void()> onReady = [dst, all, count]()
+		{
+			if (--*count == 0) dst->setValue(*all);
+		};
+		(fs.myState->addContinuation(onReady), ...);
+	}
+
+	return asyncFuture<R>(dst);
+}
+
+//  Run f() on the pool
+template <class F>
+auto asyncRun(F f) -> asyncFuture<std::decay_t<decltype(f())>>
+{
+	return when_all().then([f](const std::tuple<>&) { return f(); });
+}
+
+//  Matrix operations
+
+template <class T>
+asyncFuture<matrix<T>> matrixProductAsync(const asyncFuture<matrix<T>>& mat1, const asyncFuture<matrix<T>>& mat2)
+{
+	return when_all(mat1, mat2).then([](const std::tuple<asyncFuture<matrix<T>>, asyncFuture<matrix<T>>>& in)
+	{
+		return matrixProduct(std::get<0>(in).get(), std::get<1>(in).get());
+	});
+}
+
+//  Inputs are taken by value, move them in to avoid the copy
+template <class T>
+asyncFuture<matrix<T>> matrixProductAsync(matrix<T> mat1, matrix<T> mat2)
+{
+	return matrixProductAsync(makeReadyFuture(std::move(mat1)), makeReadyFuture(std::move(mat2)));
+}
+
+template <class T>
+asyncFuture<matrix<T>> transposeAsync(const asyncFuture<matrix<T>>& mat)
+{
+	return mat.then([](const matrix<T>& m) { return transpose(m); });
+}
+
+template <class T>
+asyncFuture<matrix<T>> transposeAsync(matrix<T> mat)
+{
+	return transposeAsync(makeReadyFuture(std::move(mat)));
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <vector>
+#include <assert.h>
+#include "matrix.h"
+#include "MatrixOps.h"
+
+//  Batched products of many small matrices, C[b] = A[b] * B[b]
+//
+//  A single matrixProduct call allocates its result, and matrixProductMT starts threads,
+//  which dwarfs the arithmetic of a 4x4. Here results are written into caller storage,
+//  the batch is split across the pool (each product stays on one thread),
+//  and common square shapes run kernels whose dimensions are template parameters,
+//  so the loops are unrolled and the row accumulator lives in registers.
+
+//  Fixed shape kernel, row-major, a is MxK, b is KxN, c is MxN
+template <size_t M, size_t K, size_t N, class T, class Acc = accumulator_t<T>>
+inline void smallProduct(const T* a, const T* b, T* c)
+{
+	for (size_t i = 0; i < M; ++i)
+	{
+		Acc acc[N] = {};
+		for (size_t k = 0; k < K; ++k)
+		{
+			const Acc aik = static_cast<Acc>(a[i * K + k]);
+			for (size_t j = 0; j < N; ++j) acc[j] += aik * static_cast<Acc>(b[k * N + j]);
+		}
+		for (size_t j = 0; j < N; ++j) c[i * N + j] = narrowCast<T>(acc[j]);
+	}
+}
+
+//  Runtime shape kernel, i-k-j as in matrixProduct2
+template <class T, class Acc = accumulator_t<T>>
+inline void smallProduct(const size_t m, const size_t k, const size_t n, const T* a, const T* b, T* c)
+{
+	for (size_t i = 0; i < m; ++i)
+	{
+		T* ci = c + i * n;
+		if constexpr (std::is_same<T, Acc>::value)
+		{
+			for (size_t j = 0; j < n; ++j) ci[j] = T(0);
+			for (size_t kk = 0; kk < k; ++kk)
+			{
+				const T aik = a[i * k + kk];
+				const T* bk = b + kk * n;
+				for (size_t j = 0; j < n; ++j) ci[j] += aik * bk[j];
+			}
+		}
+		else
+		{
+			for (size_t j = 0; j < n; ++j)
+			{
+				Acc x = 0;
+				for (size_t kk = 0; kk < k; ++kk) x += static_cast<Acc>(a[i * k + kk]) * static_cast<Acc>(b[kk * n + j]);
+				ci[j] = narrowCast<T>(x);
+			}
+		}
+	}
+}
+
+//  Calls f(kernel), kernel(a, b, c) being the fixed shape kernel for (m, k, n) if one is
+//  compiled in, the runtime one otherwise
+//  The dispatch happens once per batch, not per product
+template <class T, class F>
+void dispatchSmallProduct(const size_t m, const size_t k, const size_t n, F f)
+{
+	if (m == k && k == n)
+	{
+		switch (m)
+		{
+		case 2: f([](const T* a, const T* b, T* c) { smallProduct<2, 2, 2>(a, b, c); }); return;
+		case 3: f([](const T* a, const T* b, T* c) { smallProduct<3, 3, 3>(a, b, c); }); return;
+		case 4: f([](const T* a, const T* b, T* c) { smallProduct<4, 4, 4>(a, b, c); }); return;
+		case 8: f([](const T* a, const T* b, T* c) { smallProduct<8, 8, 8>(a, b, c); }); return;
+		case 16: f([](const T* a, const T* b, T* c) { smallProduct<16, 16, 16>(a, b, c); }); return;
+		case 32: f([](const T* a, const T* b, T* c) { smallProduct<32, 32, 32>(a, b, c); }); return;
+		case 64: f([](const T* a, const T* b, T* c) { smallProduct<64, 64, 64>(a, b, c); }); return;
+		default: break;
+		}
+	}
+	f([m, k, n](const T* a, const T* b, T* c) { smallProduct(m, k, n, a, b, c); });
+}
+
+//  Strided batch: item i of A starts at a + i * strideA, etc., in elements
+//  strideB = 0 multiplies every A[i] by the same B
+template <size_t M, size_t K, size_t N, class T>
+void batchedProductStrided(
+	const T* a, const size_t strideA,
+	const T* b, const size_t strideB,
+	T* c, const size_t strideC,
+	const size_t count)
+{
+	parallelFor(count, count * M * K * N, [=](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+			smallProduct<M, K, N>(a + i * strideA, b + i * strideB, c + i * strideC);
+	});
+}
+
+template <class T>
+void batchedProductStrided(
+	const T* a, const size_t strideA,
+	const T* b, const size_t strideB,
+	T* c, const size_t strideC,
+	const size_t count, const size_t m, const size_t k, const size_t n)
+{
+	dispatchSmallProduct<T>(m, k, n, [=](auto kernel)
+	{
+		parallelFor(count, count * m * k * n, [=](const size_t begin, const size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+				kernel(a + i * strideA, b + i * strideB, c + i * strideC);
+		});
+	});
+}
+
+//  Arrays of matrices, all A[i] of one shape and all B[i] of one shape
+//  c is resized to match; matrix::resize keeps existing storage, so reusing c
+//  across calls allocates nothing
+template <class T>
+void batchedProduct(const std::vector<matrix<T>>& a, const std::vector<matrix<T>>& b, std::vector<matrix<T>>& c)
+{
+	assert(a.size() == b.size());
+	if (a.empty())
+	{
+		c.clear();
+		return;
+	}
+
+	const size_t m = a[0].rows(), k = a[0].cols(), n = b[0].cols();
+	assert(m > 0 && k > 0 && n > 0 && b[0].rows() == k);
+	c.resize(a.size());
+
+	dispatchSmallProduct<T>(m, k, n, [&a, &b, &c, m, k, n](auto kernel)
+	{
+		parallelFor(a.size(), a.size() * m * k * n, [&a, &b, &c, m, k, n, kernel](const size_t begin, const size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				assert(a[i].rows() == m && a[i].cols() == k && b[i].rows() == k && b[i].cols() == n);
+				c[i].resize(m, n);
+				kernel(a[i][0], b[i][0], c[i][0]);
+			}
+		});
+	});
+}
+
+template <class T>
+std::vector<matrix<T>> batchedProduct(const std::vector<matrix<T>>& a, const std::vector<matrix<T>>& b)
+{
+	std::vector<matrix<T>> c;
+	batchedProduct(a, b, c);
+	return c;
+}
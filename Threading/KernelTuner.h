@@ -0,0 +1,510 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include "MatrixLayout.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+//  matrix.h includes this header before its kernels, which are only named from templates
+//  below and found when those are instantiated. Including this header first works too.
+#include "matrix.h"
+
+//  Auto-tuning of matrixProduct
+//
+//  Which kernel wins, the best block size, and from which size threads pay for their
+//  start-up, all depend on the machine. Tuning an element type runs every candidate on
+//  square shapes from 16 to setMaxTuneSize (512), keeps the fastest serial and the fastest
+//  parallel configuration per shape, and derives the crossover: the size from which the
+//  parallel one wins for good.
+//
+//  Tuning takes from a fraction of a second to seconds, more with more cores, so it never
+//  happens behind a plain matrixProduct by default: until T is tuned, by tune<T>() e.g. at
+//  start-up or from a loaded profile, its products run matrixProduct2. With setAutoTune(true),
+//  the first matrixProduct on an untuned T tunes it on the calling thread, outside the lock:
+//  other threads run matrixProduct2 meanwhile instead of waiting.
+//  With setProfilePath, results are saved to that file and read back on later runs, so
+//  tuning happens once per host: the file records the CPU model and the hardware threads,
+//  and is ignored elsewhere. Without a path nothing is written.
+//
+//  A product then runs the configuration tuned for the nearest amount of work, m*k*n,
+//  serial below the crossover and parallel above. Once T is tuned, the choice reads the
+//  published profile through an atomic pointer and takes no lock.
+
+enum productKernel
+{
+	kernelNaive,        //  matrixProductNaive, i-j-k
+	kernelIKJ,          //  matrixProduct2
+	kernelBlocked,      //  matrixProductBlocked
+	kernelParallel      //  matrixProductMT
+};
+
+inline const char* kernelName(const productKernel k)
+{
+	static const char* names[] = { "naive", "ikj", "blocked", "parallel" };
+	return names[k];
+}
+
+struct kernelChoice
+{
+	productKernel   kernel = kernelIKJ;
+	size_t          block = 0;      //  0 for unblocked
+	size_t          threads = 1;
+	double          seconds = 0;    //  measured, per product at the tuned shape
+};
+
+//  Tuned configurations of one element type
+struct kernelProfile
+{
+	//  m*k*n from which products go parallel
+	double                                      crossover = std::numeric_limits<double>::infinity();
+	//  By work (m*k*n) of the tuned shape
+	std::map<double, kernelChoice>              serial;
+	std::map<double, kernelChoice>              parallel;
+};
+
+template <class T>
+matrix<T> runProduct(const kernelChoice& c, const matrix<T>& mat1, const matrix<T>& mat2)
+{
+	switch (c.kernel)
+	{
+	case kernelNaive: return matrixProductNaive(mat1, mat2);
+	case kernelBlocked: return matrixProductBlocked(mat1, mat2, c.block);
+	case kernelParallel: return matrixProductMT(mat1, mat2, c.threads, c.block);
+	default: return matrixProduct2(mat1, mat2);
+	}
+}
+
+class kernelTuner
+{
+	typedef std::atomic<const kernelProfile*> publishedProfile;
+
+	std::mutex                                              myMutex;
+	std::map<std::string, std::unique_ptr<kernelProfile>>   myProfiles;
+	//  Replaced profiles, kept alive as lock-free readers may still hold them
+	std::vector<std::unique_ptr<kernelProfile>>             myRetired;
+	//  Per type, where its profile is published, and the types being tuned
+	std::map<std::string, publishedProfile*>                myPublished;
+	std::set<std::string>                                   myTuning;
+	std::string                                             myPath;
+	bool                                                    myLoaded;
+	bool                                                    myAutoTune;
+	size_t                                                  myMaxSize;
+
+	kernelTuner() : myLoaded(false), myAutoTune(false), myMaxSize(512) {}
+
+	static size_t hostThreads() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+	//  CPU brand string, with no spaces so it reads back as one token
+	static std::string cpuModel()
+	{
+		char brand[49] = {};
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		int r[4];
+		__cpuid(r, 0x80000000);
+		if (static_cast<unsigned>(r[0]) >= 0x80000004)
+		{
+			for (int i = 0; i < 3; ++i)
+			{
+				__cpuid(r, 0x80000002 + i);
+				std::memcpy(brand + 16 * i, r, 16);
+			}
+		}
+#elif defined(__x86_64__) || defined(__i386__)
+		unsigned r[4];
+		if (__get_cpuid_max(0x80000000, nullptr) >= 0x80000004)
+		{
+			for (unsigned i = 0; i < 3; ++i)
+			{
+				__get_cpuid(0x80000002 + i, &r[0], &r[1], &r[2], &r[3]);
+				std::memcpy(brand + 16 * i, r, 16);
+			}
+		}
+#endif
+		std::string s;
+		for (const char* c = brand; *c; ++c)
+		{
+			if (*c != ' ') s += *c;
+			else if (!s.empty() && s.back() != '_') s += '_';
+		}
+		while (!s.empty() && s.back() == '_') s.pop_back();
+		return s.empty() ? "unknown" : s;
+	}
+
+	//  Profile keys, with no spaces so they read back as one token
+	template <class T>
+	static std::string typeKey()
+	{
+		std::string s = typeid(T).name();
+		for (char& c : s) if (c == ' ') c = '_';
+		return s;
+	}
+
+	//  Where T's profile is published, read by choose() without the lock
+	template <class T>
+	static publishedProfile& published()
+	{
+		static publishedProfile p(nullptr);
+		return p;
+	}
+
+	//  Served, without the lock, to types left untuned, as matrixProduct2
+	static const kernelProfile* untuned()
+	{
+		static const kernelProfile prof;
+		return &prof;
+	}
+
+	//  Expects myMutex held
+	//  Readers fall back to the locked path, and republish, on their next product
+	void unpublishAll()
+	{
+		for (auto& p : myPublished) p.second->store(nullptr, std::memory_order_release);
+	}
+
+	//  Expects myMutex held
+	void store(const std::string& key, std::unique_ptr<kernelProfile> prof)
+	{
+		std::unique_ptr<kernelProfile>& slot = myProfiles[key];
+		if (slot) myRetired.push_back(std::move(slot));
+		slot = std::move(prof);
+		auto it = myPublished.find(key);
+		if (it != myPublished.end()) it->second->store(slot.get(), std::memory_order_release);
+	}
+
+	//  Profile file, text
+	//      matrixProduct.profile 2 <hardware threads> <cpu model>
+	//      <type> crossover <work>     (absent if serial won throughout)
+	//      <type> serial|parallel <work> <kernel> <block> <threads> <seconds>
+	//  A missing, unreadable, or other host's file is ignored, and tuning redone
+	//  Expects myMutex held
+	void load()
+	{
+		myLoaded = true;
+		if (myPath.empty()) return;
+		std::ifstream in(myPath);
+		std::string magic, model;
+		int version = 0;
+		size_t threads = 0;
+		if (!(in >> magic >> version >> threads >> model) || magic != "matrixProduct.profile" || version != 2
+			|| threads != hostThreads() || model != cpuModel()) return;
+
+		std::map<std::string, std::unique_ptr<kernelProfile>> read;
+		std::string line;
+		std::getline(in, line);
+		while (std::getline(in, line))
+		{
+			std::istringstream ls(line);
+			std::string type, what;
+			double work;
+			if (!(ls >> type >> what >> work)) continue;
+			std::unique_ptr<kernelProfile>& prof = read[type];
+			if (!prof) prof.reset(new kernelProfile);
+			if (what == "crossover")
+			{
+				prof->crossover = work;
+				continue;
+			}
+
+			std::string name;
+			kernelChoice c;
+			if (!(ls >> name >> c.block >> c.threads >> c.seconds)) continue;
+			for (int k = kernelNaive; k <= kernelParallel; ++k)
+				if (name == kernelName(productKernel(k))) c.kernel = productKernel(k);
+			if (what == "serial") prof->serial[work] = c;
+			else if (what == "parallel") prof->parallel[work] = c;
+		}
+
+		for (auto& p : read) store(p.first, std::move(p.second));
+	}
+
+	//  Best effort, an unwritable path only costs a retune next run
+	//  Expects myMutex held
+	void save() const
+	{
+		if (myPath.empty()) return;
+		std::ofstream out(myPath);
+		out << "matrixProduct.profile 2 " << hostThreads() << " " << cpuModel() << "\n" << std::setprecision(17);
+		for (const auto& p : myProfiles)
+		{
+			const kernelProfile& prof = *p.second;
+			//  No line when serial won throughout
+			if (std::isfinite(prof.crossover)) out << p.first << " crossover " << prof.crossover << "\n";
+			for (const auto& e : prof.serial)
+				out << p.first << " serial " << e.first << " " << kernelName(e.second.kernel) << " " << e.second.block << " " << e.second.threads << " " << e.second.seconds << "\n";
+			for (const auto& e : prof.parallel)
+				out << p.first << " parallel " << e.first << " " << kernelName(e.second.kernel) << " " << e.second.block << " " << e.second.threads << " " << e.second.seconds << "\n";
+		}
+	}
+
+	//  Best of a few runs, the first one warms the caches and is not counted
+	template <class T>
+	static double timeProduct(const kernelChoice& c, const matrix<T>& a, const matrix<T>& b)
+	{
+		typedef std::chrono::steady_clock clock;
+		runProduct(c, a, b);
+		double best = std::numeric_limits<double>::infinity(), total = 0;
+		for (int rep = 0; rep < 10 && (rep == 0 || total < 0.03); ++rep)
+		{
+			const clock::time_point t0 = clock::now();
+			matrix<T> res = runProduct(c, a, b);
+			const double t = std::chrono::duration<double>(clock::now() - t0).count();
+			best = std::min(best, t);
+			total += t;
+		}
+		return best;
+	}
+
+	template <class T>
+	static kernelChoice fastest(const std::vector<kernelChoice>& candidates, const matrix<T>& a, const matrix<T>& b)
+	{
+		kernelChoice best;
+		best.seconds = std::numeric_limits<double>::infinity();
+		for (kernelChoice c : candidates)
+		{
+			c.seconds = timeProduct(c, a, b);
+			if (c.seconds < best.seconds) best = c;
+		}
+		return best;
+	}
+
+	//  Runs without the lock, maxSize read under it
+	template <class T>
+	static kernelProfile tuneProfile(const size_t maxSize)
+	{
+		kernelProfile prof;
+		std::vector<double> parallelWins;
+
+		//  Powers of 2, and all the hardware threads
+		const size_t hc = hostThreads();
+		std::vector<size_t> threadCounts;
+		for (size_t t = 2; t < hc; t *= 2) threadCounts.push_back(t);
+		if (hc > 1) threadCounts.push_back(hc);
+
+		for (size_t n = 16; n <= maxSize; n *= 2)
+		{
+			matrix<T> a(n, n), b(n, n);
+			for (size_t i = 0; i < a.myVector.size(); ++i)
+			{
+				a.myVector[i] = static_cast<T>(1 + i % 7);
+				b.myVector[i] = static_cast<T>(1 + i % 5);
+			}
+
+			std::vector<kernelChoice> serial, parallel;
+			//  The naive kernel only stands a chance on small shapes
+			if (n <= 128) serial.push_back({ kernelNaive, 0, 1 });
+			serial.push_back({ kernelIKJ, 0, 1 });
+			for (size_t block : { 32, 64, 128 })
+				if (block < n) serial.push_back({ kernelBlocked, block, 1 });
+
+			for (const size_t t : threadCounts)
+			{
+				if (t > n) break;
+				parallel.push_back({ kernelParallel, 0, t });
+				if (64 < n) parallel.push_back({ kernelParallel, 64, t });
+			}
+
+			const double work = double(n) * n * n;
+			prof.serial[work] = fastest(serial, a, b);
+			if (!parallel.empty())
+			{
+				prof.parallel[work] = fastest(parallel, a, b);
+				if (prof.parallel[work].seconds < prof.serial[work].seconds) parallelWins.push_back(work);
+				else parallelWins.clear();
+			}
+		}
+
+		//  Smallest shape from which parallel won at every larger shape
+		if (!parallelWins.empty()) prof.crossover = parallelWins.front();
+		return prof;
+	}
+
+	//  Entry tuned for the work nearest to w, in log scale
+	static const kernelChoice* nearest(const std::map<double, kernelChoice>& entries, const double w)
+	{
+		if (entries.empty()) return nullptr;
+		auto hi = entries.lower_bound(w);
+		if (hi == entries.end()) return &std::prev(hi)->second;
+		if (hi == entries.begin()) return &hi->second;
+		auto lo = std::prev(hi);
+		return std::log(w / lo->first) < std::log(hi->first / w) ? &lo->second : &hi->second;
+	}
+
+	//  Tunes T and publishes the result, unless another thread is already tuning it
+	//  Returns false in that case
+	template <class T>
+	bool tuneUnlocked(std::unique_lock<std::mutex>& lk)
+	{
+		const std::string key = typeKey<T>();
+		if (!myTuning.insert(key).second) return false;
+		const size_t maxSize = myMaxSize;
+
+		lk.unlock();
+		std::unique_ptr<kernelProfile> prof;
+		try
+		{
+			prof.reset(new kernelProfile(tuneProfile<T>(maxSize)));
+		}
+		catch (...)
+		{
+			lk.lock();
+			myTuning.erase(key);
+			throw;
+		}
+		lk.lock();
+
+		myTuning.erase(key);
+		store(key, std::move(prof));
+		save();
+		return true;
+	}
+
+	//  Locked path of choose(): loads the profile file, registers where T's profile is
+	//  published, and tunes T if needed. Returns null while another thread tunes T.
+	template <class T>
+	const kernelProfile* acquire()
+	{
+		std::unique_lock<std::mutex> lk(myMutex);
+		const std::string key = typeKey<T>();
+		publishedProfile& pub = published<T>();
+		myPublished[key] = &pub;
+		if (!myLoaded) load();
+
+		auto it = myProfiles.find(key);
+		if (it != myProfiles.end())
+		{
+			pub.store(it->second.get(), std::memory_order_release);
+			return it->second.get();
+		}
+
+		if (!myAutoTune)
+		{
+			pub.store(untuned(), std::memory_order_release);
+			return untuned();
+		}
+
+		if (!tuneUnlocked<T>(lk)) return nullptr;
+		return myProfiles[key].get();
+	}
+
+public:
+
+	static kernelTuner* getInstance()
+	{
+		static kernelTuner instance;
+		return &instance;
+	}
+
+	//  Profile file, read on the next product and written after each tuning
+	//  Empty, the default, keeps profiles in memory only
+	void setProfilePath(const std::string& path)
+	{
+		std::lock_guard<std::mutex> lk(myMutex);
+		myPath = path;
+		myLoaded = false;
+		for (auto& p : myProfiles) myRetired.push_back(std::move(p.second));
+		myProfiles.clear();
+		unpublishAll();
+	}
+
+	//  On: the first product on an untuned type tunes it, on that product's thread
+	//  Off, the default: untuned types run matrixProduct2
+	void setAutoTune(const bool on)
+	{
+		std::lock_guard<std::mutex> lk(myMutex);
+		myAutoTune = on;
+		unpublishAll();
+	}
+
+	//  Largest square shape tuned, tuning time grows with its cube
+	void setMaxTuneSize(const size_t n)
+	{
+		std::lock_guard<std::mutex> lk(myMutex);
+		myMaxSize = std::max(size_t(16), n);
+	}
+
+	//  Tune T now, on the calling thread, unless the profile already has it, or force
+	//  Saves the profile when a path is set
+	template <class T>
+	void tune(const bool force = false)
+	{
+		std::unique_lock<std::mutex> lk(myMutex);
+		myPublished[typeKey<T>()] = &published<T>();
+		if (!myLoaded) load();
+		if (!force && myProfiles.count(typeKey<T>())) return;
+		tuneUnlocked<T>(lk);
+	}
+
+	//  Configuration for an m x k by k x n product
+	//  Lock-free once T's profile is published
+	template <class T>
+	kernelChoice choose(const size_t m, const size_t k, const size_t n)
+	{
+		const kernelProfile* prof = published<T>().load(std::memory_order_acquire);
+		if (!prof) prof = acquire<T>();
+		if (!prof) return kernelChoice();
+
+		const double work = double(m) * k * n;
+		const kernelChoice* c = work >= prof->crossover ? nearest(prof->parallel, work) : nullptr;
+		if (!c) c = nearest(prof->serial, work);
+		if (!c) return kernelChoice();
+
+		kernelChoice res = *c;
+		//  No more threads than rows, and no blocks wider than the matrices
+		if (res.threads > m) res.threads = std::max(size_t(1), m);
+		if (res.block >= std::max(k, n)) res.block = 0;
+		return res;
+	}
+
+	//  Tuned configurations, per type
+	void report(std::ostream& os)
+	{
+		std::lock_guard<std::mutex> lk(myMutex);
+		if (!myLoaded) load();
+		os << "host " << cpuModel() << ", " << hostThreads() << " threads\n";
+		for (const auto& p : myProfiles)
+		{
+			const kernelProfile& prof = *p.second;
+			os << "type " << p.first;
+			if (std::isfinite(prof.crossover)) os << ", parallel from " << std::cbrt(prof.crossover) << "^3\n";
+			else os << ", serial throughout\n";
+			for (const auto* entries : { &prof.serial, &prof.parallel })
+			{
+				for (const auto& e : *entries)
+				{
+					os << "    " << std::setw(5) << std::cbrt(e.first) << "^3 " << std::setw(9) << kernelName(e.second.kernel)
+						<< " block " << std::setw(3) << e.second.block << " threads " << std::setw(2) << e.second.threads
+						<< " " << e.second.seconds * 1e3 << " ms\n";
+				}
+			}
+		}
+	}
+};
+
+template <class T>
+matrix<T> matrixProductTuned(const matrix<T>& mat1, const matrix<T>& mat2)
+{
+	assert(mat1.cols() == mat2.rows());
+	return runProduct(kernelTuner::getInstance()->choose<T>(mat1.rows(), mat1.cols(), mat2.cols()), mat1, mat2);
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <assert.h>
+#include "SeqLock.h"
+#include "SpinWait.h"
+
+//  Accounts for read-heavy workloads
+//  Writers take a per-account mutex, readers go through per-account seqlocks
+//  and never take a lock, so reporting threads neither block each other nor the writers
+
+class ledger
+{
+	struct alignas(cacheLineSize) account
+	{
+		mutable std::mutex      myMutex;    //  serializes writers
+		seqLock                 mySeq;
+		std::atomic<double>     myBalance;
+
+		account() : myBalance(0) {}
+	};
+
+	std::vector<account> myAccounts;
+
+	//  Retries of the lock-free snapshot before falling back to locking the range
+	static constexpr int maxSnapshotRetries = 64;
+
+	static void set(account& a, const double balance)
+	{
+		a.mySeq.writeBegin();
+		a.myBalance.store(balance, std::memory_order_relaxed);
+		a.mySeq.writeEnd();
+	}
+
+public:
+
+	explicit ledger(const size_t n) : myAccounts(n) {}
+
+	//  Non copyable
+	ledger(const ledger&) = delete;
+	ledger& operator=(const ledger&) = delete;
+
+	size_t size() const { return myAccounts.size(); }
+
+	void deposit(const size_t i, const double amount)
+	{
+		account& a = myAccounts[i];
+		std::lock_guard<std::mutex> lg(a.myMutex);
+		set(a, a.myBalance.load(std::memory_order_relaxed) + amount);
+	}
+
+	//  Refused if it would make the balance negative
+	bool withdraw(const size_t i, const double amount)
+	{
+		account& a = myAccounts[i];
+		std::lock_guard<std::mutex> lg(a.myMutex);
+		const double balance = a.myBalance.load(std::memory_order_relaxed);
+		if (balance < amount) return false;
+		set(a, balance - amount);
+		return true;
+	}
+
+	//  Both accounts change inside one write section, snapshots see before or after, never half
+	bool transfer(const size_t from, const size_t to, const double amount)
+	{
+		if (from == to) return true;
+		account& a = myAccounts[from];
+		account& b = myAccounts[to];
+		std::scoped_lock lk(a.myMutex, b.myMutex);
+		const double balance = a.myBalance.load(std::memory_order_relaxed);
+		if (balance < amount) return false;
+		a.mySeq.writeBegin();
+		b.mySeq.writeBegin();
+		a.myBalance.store(balance - amount, std::memory_order_relaxed);
+		b.myBalance.store(b.myBalance.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+		b.mySeq.writeEnd();
+		a.mySeq.writeEnd();
+		return true;
+	}
+
+	//  Lock-free
+	double getBalance(const size_t i) const
+	{
+		const account& a = myAccounts[i];
+		uint64_t s;
+		double balance;
+		do
+		{
+			s = a.mySeq.readBegin();
+			balance = a.myBalance.load(std::memory_order_relaxed);
+		} while (a.mySeq.readRetry(s));
+		return balance;
+	}
+
+	//  Consistent balances of accounts [first, last), as of a single instant
+	//  Reads every account with its sequence, then checks that no sequence moved:
+	//  if none did, all values held simultaneously at the start of the check
+	//  Under sustained write traffic on the range, falls back to locking it
+	std::vector<double> snapshot(const size_t first, const size_t last) const
+	{
+		assert(first <= last && last <= myAccounts.size());
+		std::vector<double> res(last - first);
+		std::vector<uint64_t> seqs(last - first);
+
+		for (int attempt = 0; attempt < maxSnapshotRetries; ++attempt)
+		{
+			for (size_t i = first; i < last; ++i)
+			{
+				seqs[i - first] = myAccounts[i].mySeq.readBegin();
+				res[i - first] = myAccounts[i].myBalance.load(std::memory_order_relaxed);
+			}
+
+			bool consistent = true;
+			for (size_t i = first; i < last && consistent; ++i)
+				consistent = !myAccounts[i].mySeq.readRetry(seqs[i - first]);
+			if (consistent) return res;
+		}
+
+		//  Lock in index order, transfer() uses scoped_lock which backs off, so no deadlock
+		std::vector<std::unique_lock<std::mutex>> locks;
+		locks.reserve(last - first);
+		for (size_t i = first; i < last; ++i)
+			locks.emplace_back(myAccounts[i].myMutex);
+		for (size_t i = first; i < last; ++i)
+			res[i - first] = myAccounts[i].myBalance.load(std::memory_order_relaxed);
+
+		return res;
+	}
+
+	double totalBalance(const size_t first, const size_t last) const
+	{
+		double total = 0;
+		for (const double b : snapshot(first, last)) total += b;
+		return total;
+	}
+};
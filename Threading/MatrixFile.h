@@ -0,0 +1,419 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include "matrix.h"
+#include "ParallelQueue.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//  Binary matrix file, memory mapped views and out-of-core products
+//
+//  Layout on disk:
+//      matrixFileHeader
+//      zero padding up to dataOffset (a multiple of alignment)
+//      rows*cols elements of T, row-major, native endianness
+
+enum class matrixFileType : uint32_t
+{
+	f64 = 1, f32, i64, i32, i16, i8, u8, bf16, f16
+};
+
+template <class T> struct matrixFileTypeOf;
+template <> struct matrixFileTypeOf<double> { static constexpr matrixFileType value = matrixFileType::f64; };
+template <> struct matrixFileTypeOf<float> { static constexpr matrixFileType value = matrixFileType::f32; };
+template <> struct matrixFileTypeOf<int64_t> { static constexpr matrixFileType value = matrixFileType::i64; };
+template <> struct matrixFileTypeOf<int32_t> { static constexpr matrixFileType value = matrixFileType::i32; };
+template <> struct matrixFileTypeOf<int16_t> { static constexpr matrixFileType value = matrixFileType::i16; };
+template <> struct matrixFileTypeOf<int8_t> { static constexpr matrixFileType value = matrixFileType::i8; };
+template <> struct matrixFileTypeOf<uint8_t> { static constexpr matrixFileType value = matrixFileType::u8; };
+template <> struct matrixFileTypeOf<bfloat16> { static constexpr matrixFileType value = matrixFileType::bf16; };
+template <> struct matrixFileTypeOf<half> { static constexpr matrixFileType value = matrixFileType::f16; };
+
+enum class matrixFileLayout : uint32_t
+{
+	rowMajor = 0
+};
+
+struct matrixFileHeader
+{
+	char     magic[8];      //  "MATRIXF\0"
+	uint32_t version;
+	uint32_t type;          //  matrixFileType
+	uint32_t elemSize;
+	uint32_t layout;        //  matrixFileLayout
+	uint64_t rows;
+	uint64_t cols;
+	uint64_t alignment;
+	uint64_t dataOffset;
+};
+
+static const char matrixFileMagic[8] = { 'M', 'A', 'T', 'R', 'I', 'X', 'F', '\0' };
+static const uint32_t matrixFileVersion = 1;
+
+template <class T>
+matrixFileHeader makeMatrixFileHeader(const size_t rows, const size_t cols, const size_t alignment)
+{
+	assert(alignment && (alignment & (alignment - 1)) == 0);
+	matrixFileHeader h;
+	std::memset(&h, 0, sizeof(h));
+	std::memcpy(h.magic, matrixFileMagic, sizeof(h.magic));
+	h.version = matrixFileVersion;
+	h.type = static_cast<uint32_t>(matrixFileTypeOf<T>::value);
+	h.elemSize = sizeof(T);
+	h.layout = static_cast<uint32_t>(matrixFileLayout::rowMajor);
+	h.rows = rows;
+	h.cols = cols;
+	h.alignment = alignment;
+	h.dataOffset = (sizeof(h) + alignment - 1) / alignment * alignment;
+	return h;
+}
+
+template <class T>
+void checkMatrixFileHeader(const matrixFileHeader& h, const std::string& path)
+{
+	if (std::memcmp(h.magic, matrixFileMagic, sizeof(h.magic)) != 0)
+		throw std::runtime_error(path + ": not a matrix file");
+	if (h.version != matrixFileVersion)
+		throw std::runtime_error(path + ": unsupported matrix file version");
+	if (h.type != static_cast<uint32_t>(matrixFileTypeOf<T>::value) || h.elemSize != sizeof(T))
+		throw std::runtime_error(path + ": element type mismatch");
+	if (h.layout != static_cast<uint32_t>(matrixFileLayout::rowMajor))
+		throw std::runtime_error(path + ": unsupported layout");
+}
+
+//  Sequential writer, rows are appended in order
+//  Used for whole matrices and for results streamed out block by block
+template <class T>
+class matrixFileWriter
+{
+	std::ofstream       myStream;
+	std::string         myPath;
+	size_t              myRows;
+	size_t              myCols;
+	size_t              myWritten;
+
+public:
+
+	matrixFileWriter(const std::string& path, const size_t rows, const size_t cols, const size_t alignment = 64)
+		: myStream(path, std::ios::binary | std::ios::trunc), myPath(path), myRows(rows), myCols(cols), myWritten(0)
+	{
+		if (!myStream) throw std::runtime_error(path + ": cannot open for writing");
+		const matrixFileHeader h = makeMatrixFileHeader<T>(rows, cols, alignment);
+		myStream.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		const std::vector<char> pad(h.dataOffset - sizeof(h), 0);
+		myStream.write(pad.data(), pad.size());
+	}
+
+	//  Append n full rows
+	void writeRows(const T* data, const size_t n)
+	{
+		assert(myWritten + n <= myRows);
+		myStream.write(reinterpret_cast<const char*>(data), n * myCols * sizeof(T));
+		if (!myStream) throw std::runtime_error(myPath + ": write failed");
+		myWritten += n;
+	}
+
+	void close()
+	{
+		assert(myWritten == myRows);
+		myStream.close();
+		if (myStream.fail()) throw std::runtime_error(myPath + ": close failed");
+	}
+};
+
+template <class T>
+void writeMatrixFile(const std::string& path, const matrix<T>& mat, const size_t alignment = 64)
+{
+	matrixFileWriter<T> writer(path, mat.rows(), mat.cols(), alignment);
+	if (!mat.empty()) writer.writeRows(mat[0], mat.rows());
+	writer.close();
+}
+
+//  Read-only mapping of a whole file, RAII
+class mappedFile
+{
+	const char* myData;
+	size_t      mySize;
+#ifdef _WIN32
+	HANDLE      myFile;
+	HANDLE      myMapping;
+#endif
+
+	void release()
+	{
+#ifdef _WIN32
+		if (myData) UnmapViewOfFile(myData);
+		if (myMapping) CloseHandle(myMapping);
+		if (myFile != INVALID_HANDLE_VALUE) CloseHandle(myFile);
+		myMapping = nullptr;
+		myFile = INVALID_HANDLE_VALUE;
+#else
+		if (myData) munmap(const_cast<char*>(myData), mySize);
+#endif
+		myData = nullptr;
+		mySize = 0;
+	}
+
+public:
+
+	mappedFile() : myData(nullptr), mySize(0)
+#ifdef _WIN32
+		, myFile(INVALID_HANDLE_VALUE), myMapping(nullptr)
+#endif
+	{}
+
+	explicit mappedFile(const std::string& path) : mappedFile()
+	{
+#ifdef _WIN32
+		myFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (myFile == INVALID_HANDLE_VALUE) throw std::runtime_error(path + ": cannot open");
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(myFile, &size)) { release(); throw std::runtime_error(path + ": cannot stat"); }
+		mySize = static_cast<size_t>(size.QuadPart);
+		myMapping = CreateFileMappingA(myFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!myMapping) { release(); throw std::runtime_error(path + ": cannot map"); }
+		myData = static_cast<const char*>(MapViewOfFile(myMapping, FILE_MAP_READ, 0, 0, 0));
+		if (!myData) { release(); throw std::runtime_error(path + ": cannot map"); }
+#else
+		const int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) throw std::runtime_error(path + ": cannot open");
+		struct stat st;
+		if (fstat(fd, &st) != 0) { close(fd); throw std::runtime_error(path + ": cannot stat"); }
+		mySize = static_cast<size_t>(st.st_size);
+		void* p = mmap(nullptr, mySize, PROT_READ, MAP_SHARED, fd, 0);
+		//  The mapping keeps its own reference to the file
+		close(fd);
+		if (p == MAP_FAILED) { mySize = 0; throw std::runtime_error(path + ": cannot map"); }
+		myData = static_cast<const char*>(p);
+		madvise(p, mySize, MADV_SEQUENTIAL);
+#endif
+	}
+
+	~mappedFile() { release(); }
+
+	//  Non copyable, movable
+	mappedFile(const mappedFile&) = delete;
+	mappedFile& operator=(const mappedFile&) = delete;
+	mappedFile(mappedFile&& rhs) : mappedFile() { swap(rhs); }
+	mappedFile& operator=(mappedFile&& rhs)
+	{
+		if (this == &rhs) return *this;
+		release();
+		swap(rhs);
+		return *this;
+	}
+
+	void swap(mappedFile& rhs)
+	{
+		std::swap(myData, rhs.myData);
+		std::swap(mySize, rhs.mySize);
+#ifdef _WIN32
+		std::swap(myFile, rhs.myFile);
+		std::swap(myMapping, rhs.myMapping);
+#endif
+	}
+
+	const char* data() const { return myData; }
+	size_t size() const { return mySize; }
+};
+
+//  Zero-copy read-only view of a matrix file
+//  Same access interface as a const matrix<T>, pages are faulted in on demand
+template <class T>
+class matrix_view
+{
+	mappedFile  myFile;
+	size_t      myRows;
+	size_t      myCols;
+	const T*    myData;
+
+public:
+
+	matrix_view() : myRows(0), myCols(0), myData(nullptr) {}
+
+	explicit matrix_view(const std::string& path) : myFile(path), myRows(0), myCols(0), myData(nullptr)
+	{
+		if (myFile.size() < sizeof(matrixFileHeader)) throw std::runtime_error(path + ": truncated header");
+		matrixFileHeader h;
+		std::memcpy(&h, myFile.data(), sizeof(h));
+		checkMatrixFileHeader<T>(h, path);
+		if (myFile.size() < h.dataOffset + h.rows * h.cols * sizeof(T)) throw std::runtime_error(path + ": truncated data");
+		myRows = static_cast<size_t>(h.rows);
+		myCols = static_cast<size_t>(h.cols);
+		myData = reinterpret_cast<const T*>(myFile.data() + h.dataOffset);
+	}
+
+	//  Access
+	size_t rows() const { return myRows; }
+	size_t cols() const { return myCols; }
+	const T* operator[] (const size_t row) const { return myData + row * myCols; }
+	bool empty() const { return myRows * myCols == 0; }
+
+	//  Iterators
+	typedef const T* const_iterator;
+	const_iterator begin() const { return myData; }
+	const_iterator end() const { return myData + myRows * myCols; }
+};
+
+//  Explicit copy into memory
+template <class T>
+matrix<T> toMatrix(const matrix_view<T>& view)
+{
+	matrix<T> res(view.rows(), view.cols());
+	std::copy(view.begin(), view.end(), res.begin());
+	return res;
+}
+
+//  Out-of-core product, file1 * file2 -> out, with O(block) memory
+//
+//  The result is produced in tiles of blockRows x blockCols, a row block at a time
+//  For each tile, mat1 and mat2 are streamed in matching tiles along k: blockRows x blockK
+//  of mat1 and blockK x blockCols of mat2
+//  A loader thread copies tiles out of the mappings (which is where the disk reads happen)
+//  into a ring of depth buffers while the calling thread computes on the previous ones
+//  Free and ready buffers travel through two ConcurrentQueues, so the loader blocks
+//  when it is depth tiles ahead. An exception on the loader reaches the caller.
+//  Memory: depth * (blockRows * blockK + blockK * blockCols) + blockRows * blockCols of Acc,
+//  plus one row block of the result, blockRows * cols of T, as rows are written in order
+template <class T, class Acc = accumulator_t<T>>
+void matrixProductOutOfCore(
+	const std::string& file1,
+	const std::string& file2,
+	const std::string& out,
+	const size_t blockRows = 256,
+	const size_t blockK = 256,
+	const size_t blockCols = 1024,
+	const size_t depth = 3)
+{
+	const matrix_view<T> mat1(file1);
+	const matrix_view<T> mat2(file2);
+	if (mat1.cols() != mat2.rows()) throw std::runtime_error("matrixProductOutOfCore: dimension mismatch");
+
+	const size_t rows = mat1.rows(), cols = mat2.cols(), inner = mat1.cols();
+	const size_t nI = (rows + blockRows - 1) / blockRows;
+	const size_t nJ = (cols + blockCols - 1) / blockCols;
+	const size_t nK = (inner + blockK - 1) / blockK;
+
+	struct tile
+	{
+		size_t i0, i1, j0, j1, k0, k1;
+		matrix<Acc> a;      //  (i1-i0) x (k1-k0) of mat1, widened
+		matrix<Acc> b;      //  (k1-k0) x (j1-j0) of mat2, widened
+	};
+	std::vector<tile> buffers(depth);
+	for (tile& t : buffers)
+	{
+		t.a.resize(blockRows, blockK);
+		t.b.resize(blockK, blockCols);
+	}
+
+	ConcurrentQueue<size_t> freeQ, readyQ;
+	for (size_t n = 0; n < depth; ++n) freeQ.push(n);
+
+	//  Set by the loader before it interrupts readyQ, read by the caller after
+	std::exception_ptr loadError;
+	auto loader = [&freeQ, &readyQ, &buffers, &mat1, &mat2, &loadError, rows, cols, inner, nI, nJ, nK, blockRows, blockK, blockCols]()
+	{
+		try
+		{
+			size_t n = 0;
+			for (size_t bi = 0; bi < nI; ++bi)
+				for (size_t bj = 0; bj < nJ; ++bj)
+					for (size_t bk = 0; bk < nK; ++bk)
+					{
+						if (!freeQ.pop(n)) return;
+						tile& t = buffers[n];
+						t.i0 = bi * blockRows;
+						t.i1 = std::min(rows, t.i0 + blockRows);
+						t.j0 = bj * blockCols;
+						t.j1 = std::min(cols, t.j0 + blockCols);
+						t.k0 = bk * blockK;
+						t.k1 = std::min(inner, t.k0 + blockK);
+						t.a.resize(t.i1 - t.i0, t.k1 - t.k0);
+						t.b.resize(t.k1 - t.k0, t.j1 - t.j0);
+						for (size_t i = t.i0; i < t.i1; ++i)
+							convertRange(mat1[i] + t.k0, t.k1 - t.k0, t.a[i - t.i0]);
+						for (size_t k = t.k0; k < t.k1; ++k)
+							convertRange(mat2[k] + t.j0, t.j1 - t.j0, t.b[k - t.k0]);
+						readyQ.push(n);
+					}
+		}
+		catch (...)
+		{
+			loadError = std::current_exception();
+			readyQ.interrupt();
+		}
+	};
+	//  Open the output first so that a failure there cannot leave the loader running
+	matrixFileWriter<T> writer(out, rows, cols);
+	std::thread loaderThread(loader);
+
+	matrix<Acc> acc(blockRows, blockCols);
+	std::vector<T> narrow(blockRows * cols);
+
+	try
+	{
+		size_t n = 0;
+		for (size_t bi = 0; bi < nI; ++bi)
+		{
+			const size_t blockSize = std::min(rows - bi * blockRows, blockRows);
+			for (size_t bj = 0; bj < nJ; ++bj)
+			{
+				const size_t j0 = bj * blockCols, width = std::min(cols - j0, blockCols);
+				acc.resize(blockSize, width);
+				std::fill(acc.begin(), acc.end(), Acc(0));
+				for (size_t bk = 0; bk < nK; ++bk)
+				{
+					//  Interrupted only by a loader failure
+					if (!readyQ.pop(n)) std::rethrow_exception(loadError);
+					const tile& t = buffers[n];
+					//  Same i-k-j kernel as matrixProductAcc, on the tile
+					for (size_t i = 0; i < t.a.rows(); ++i)
+					{
+						Acc* ri = acc[i];
+						for (size_t k = 0; k < t.a.cols(); ++k)
+						{
+							const Acc aik = t.a[i][k];
+							const Acc* bk_ = t.b[k];
+							for (size_t j = 0; j < width; ++j)
+								ri[j] += aik * bk_[j];
+						}
+					}
+					freeQ.push(n);
+				}
+				for (size_t i = 0; i < blockSize; ++i)
+					convertRange(acc[i], width, narrow.data() + i * cols + j0);
+			}
+			writer.writeRows(narrow.data(), blockSize);
+		}
+	}
+	catch (...)
+	{
+		freeQ.interrupt();
+		loaderThread.join();
+		throw;
+	}
+
+	loaderThread.join();
+	writer.close();
+}
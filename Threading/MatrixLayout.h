@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <type_traits>
+#include "Precision.h"
+
+//  Storage layouts for matrix<T, Layout>
+//  A layout maps element (i, j) of a rows x cols matrix to its position in storage
+
+//  myVector[i * cols + j], rows contiguous, the default
+struct rowMajor
+{
+	static size_t storage(const size_t rows, const size_t cols) { return rows * cols; }
+	static size_t index(const size_t i, const size_t j, const size_t, const size_t cols) { return i * cols + j; }
+};
+
+//  myVector[j * rows + i], columns contiguous
+//  The storage of a col-major matrix is the row-major storage of its transpose
+struct colMajor
+{
+	static size_t storage(const size_t rows, const size_t cols) { return rows * cols; }
+	static size_t index(const size_t i, const size_t j, const size_t rows, const size_t) { return j * rows + i; }
+};
+
+//  B x B tiles, each contiguous and row-major inside, tiles in row-major order
+//  Edge tiles are padded to full size with zeros, so kernels see only whole tiles
+template <size_t B = 32>
+struct tileMajor
+{
+	static constexpr size_t tile = B;
+
+	static size_t tilesDown(const size_t rows) { return (rows + B - 1) / B; }
+	static size_t tilesAcross(const size_t cols) { return (cols + B - 1) / B; }
+	static size_t storage(const size_t rows, const size_t cols) { return tilesDown(rows) * tilesAcross(cols) * B * B; }
+
+	//  Start of tile (ti, tj)
+	static size_t tileOffset(const size_t ti, const size_t tj, const size_t cols) { return (ti * tilesAcross(cols) + tj) * B * B; }
+	static size_t index(const size_t i, const size_t j, const size_t, const size_t cols) { return tileOffset(i / B, j / B, cols) + (i % B) * B + j % B; }
+};
+
+//  Declared here with its default, row-major, defined in matrix.h
+//  so that headers matrix.h includes can name matrix<T>
+template <class T, class Layout = rowMajor> class matrix;
+
+template <class L> struct isTileMajor : std::false_type {};
+template <size_t B> struct isTileMajor<tileMajor<B>> : std::true_type {};
+
+//  dst (cols x rows, row-major) = transpose of src (rows x cols, row-major)
+//  In 32 x 32 blocks, so that both the reads and the writes stay within a few cache lines
+template <class U, class T>
+inline void transposeBlocked(const U* src, const size_t rows, const size_t cols, T* dst)
+{
+	const size_t blk = 32;
+	for (size_t ii = 0; ii < rows; ii += blk)
+	{
+		const size_t i1 = std::min(rows, ii + blk);
+		for (size_t jj = 0; jj < cols; jj += blk)
+		{
+			const size_t j1 = std::min(cols, jj + blk);
+			for (size_t i = ii; i < i1; ++i)
+				for (size_t j = jj; j < j1; ++j)
+					dst[j * rows + i] = narrowCast<T>(src[i * cols + j]);
+		}
+	}
+}
+
+//  Copies a rows x cols matrix from From storage into To storage, converting U to T
+//  with narrowCast, as the same-layout conversions do, so integers saturate in any layout
+//  dst must be sized To::storage(rows, cols), with any tile padding already zero
+template <class From, class To, class U, class T>
+inline void convertStorage(const U* src, T* dst, const size_t rows, const size_t cols)
+{
+	if constexpr (std::is_same<From, To>::value)
+	{
+		convertRange(src, From::storage(rows, cols), dst);
+	}
+	//  Row <-> col is a transpose of the storage
+	else if constexpr (std::is_same<From, rowMajor>::value && std::is_same<To, colMajor>::value)
+	{
+		transposeBlocked(src, rows, cols, dst);
+	}
+	else if constexpr (std::is_same<From, colMajor>::value && std::is_same<To, rowMajor>::value)
+	{
+		transposeBlocked(src, cols, rows, dst);
+	}
+	//  Row <-> tile moves contiguous runs of up to B elements
+	else if constexpr (std::is_same<From, rowMajor>::value && isTileMajor<To>::value)
+	{
+		const size_t B = To::tile;
+		for (size_t i = 0; i < rows; ++i)
+			for (size_t j = 0; j < cols; j += B)
+				std::transform(src + i * cols + j, src + i * cols + std::min(cols, j + B), dst + To::index(i, j, rows, cols),
+					[](const U& u) { return narrowCast<T>(u); });
+	}
+	else if constexpr (isTileMajor<From>::value && std::is_same<To, rowMajor>::value)
+	{
+		const size_t B = From::tile;
+		for (size_t i = 0; i < rows; ++i)
+			for (size_t j = 0; j < cols; j += B)
+			{
+				const U* s = src + From::index(i, j, rows, cols);
+				std::transform(s, s + (std::min(cols, j + B) - j), dst + i * cols + j, [](const U& u) { return narrowCast<T>(u); });
+			}
+	}
+	//  Anything else element by element
+	else
+	{
+		for (size_t i = 0; i < rows; ++i)
+			for (size_t j = 0; j < cols; ++j)
+				dst[To::index(i, j, rows, cols)] = narrowCast<T>(src[From::index(i, j, rows, cols)]);
+	}
+}
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <exception>
+#include <assert.h>
+#include "matrix.h"
+#include "ThreadPool.h"
+
+//  Element-wise operations and row/column reductions on matrix<T>
+//
+//  Work is split into contiguous chunks run on the shared ThreadPool, the calling thread
+//  takes the first chunk and helps with the rest through activeWait.
+//  Below parallelThreshold elements, or with the pool stopped, everything runs inline.
+//  Inner loops are flat over raw pointers so the compiler vectorizes them.
+
+//  Elements below which an operation stays on the calling thread
+inline size_t parallelThreshold = 1 << 15;
+
+//  f(begin, end) over [0, n), split in up to numThreads+1 chunks
+//  work is the number of elements touched, compared with parallelThreshold
+//  An exception from any chunk is rethrown, the first one only, once all chunks are done:
+//  the tasks reference f, so none may outlive this call
+template <class F>
+void parallelFor(const size_t n, const size_t work, F f)
+{
+	ThreadPool* pool = ThreadPool::getInstance();
+	const size_t nChunks = std::min(n, pool->numThreads() + 1);
+	if (work < parallelThreshold || nChunks <= 1)
+	{
+		f(size_t(0), n);
+		return;
+	}
+
+	const size_t step = (n + nChunks - 1) / nChunks;
+	std::vector<TaskHandle> futures;
+	futures.reserve(nChunks - 1);
+	std::exception_ptr error;
+	try
+	{
+		for (size_t begin = step; begin < n; begin += step)
+		{
+			const size_t end = std::min(n, begin + step);
+			futures.push_back(pool->spawnTask([&f, begin, end]()
+			{
+				f(begin, end);
+				return true;
+			}));
+		}
+
+		f(size_t(0), std::min(n, step));
+	}
+	catch (...)
+	{
+		error = std::current_exception();
+	}
+
+	for (TaskHandle& fut : futures)
+	{
+		pool->activeWait(fut);
+		try
+		{
+			fut.get();
+		}
+		catch (...)
+		{
+			if (!error) error = std::current_exception();
+		}
+	}
+
+	if (error) std::rethrow_exception(error);
+}
+
+//  Element-wise
+
+template <class T>
+void fill(matrix<T>& mat, const T value)
+{
+	T* p = mat.empty() ? nullptr : mat[0];
+	const size_t n = mat.rows() * mat.cols();
+	parallelFor(n, n, [p, value](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i) p[i] = value;
+	});
+}
+
+//  mat *= a
+template <class T>
+void scale(matrix<T>& mat, const T a)
+{
+	T* p = mat.empty() ? nullptr : mat[0];
+	const size_t n = mat.rows() * mat.cols();
+	parallelFor(n, n, [p, a](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i) p[i] *= a;
+	});
+}
+
+//  y += a * x
+template <class T>
+void axpy(const T a, const matrix<T>& x, matrix<T>& y)
+{
+	assert(x.rows() == y.rows() && x.cols() == y.cols());
+	const T* px = x.empty() ? nullptr : x[0];
+	T* py = y.empty() ? nullptr : y[0];
+	const size_t n = x.rows() * x.cols();
+	parallelFor(n, n, [a, px, py](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i) py[i] += a * px[i];
+	});
+}
+
+//  res[i][j] = f(mat[i][j])
+template <class T, class F>
+auto map(const matrix<T>& mat, F f) -> matrix<std::decay_t<decltype(f(std::declval<const T&>()))>>
+{
+	typedef std::decay_t<decltype(f(std::declval<const T&>()))> R;
+	matrix<R> res(mat.rows(), mat.cols());
+	const T* p = mat.empty() ? nullptr : mat[0];
+	R* r = res.empty() ? nullptr : res[0];
+	const size_t n = mat.rows() * mat.cols();
+	parallelFor(n, n, [&f, p, r](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i) r[i] = f(p[i]);
+	});
+	return res;
+}
+
+//  mat[i][j] = f(mat[i][j])
+template <class T, class F>
+void mapInPlace(matrix<T>& mat, F f)
+{
+	T* p = mat.empty() ? nullptr : mat[0];
+	const size_t n = mat.rows() * mat.cols();
+	parallelFor(n, n, [&f, p](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i) p[i] = f(p[i]);
+	});
+}
+
+//  Row reductions, parallel over rows, each row is a contiguous scan
+
+template <class T>
+std::vector<accumulator_t<T>> rowSums(const matrix<T>& mat)
+{
+	typedef accumulator_t<T> Acc;
+	std::vector<Acc> res(mat.rows());
+	parallelFor(mat.rows(), mat.rows() * mat.cols(), [&mat, &res](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const T* ai = mat[i];
+			Acc s = 0;
+			for (size_t j = 0; j < mat.cols(); ++j) s += static_cast<Acc>(ai[j]);
+			res[i] = s;
+		}
+	});
+	return res;
+}
+
+template <class T>
+std::vector<T> rowMax(const matrix<T>& mat)
+{
+	assert(mat.cols() > 0);
+	std::vector<T> res(mat.rows());
+	parallelFor(mat.rows(), mat.rows() * mat.cols(), [&mat, &res](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const T* ai = mat[i];
+			T m = ai[0];
+			for (size_t j = 1; j < mat.cols(); ++j) m = ai[j] > m ? ai[j] : m;
+			res[i] = m;
+		}
+	});
+	return res;
+}
+
+//  First index of the max in each row
+template <class T>
+std::vector<size_t> rowArgmax(const matrix<T>& mat)
+{
+	assert(mat.cols() > 0);
+	std::vector<size_t> res(mat.rows());
+	parallelFor(mat.rows(), mat.rows() * mat.cols(), [&mat, &res](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const T* ai = mat[i];
+			size_t k = 0;
+			for (size_t j = 1; j < mat.cols(); ++j) if (ai[j] > ai[k]) k = j;
+			res[i] = k;
+		}
+	});
+	return res;
+}
+
+//  Column reductions
+//  A column walk strides through memory, so instead each chunk of rows folds its rows
+//  into a private row-sized partial with contiguous (vectorized) updates,
+//  and the partials are combined in chunk order at the end
+
+template <class T>
+std::vector<accumulator_t<T>> colSums(const matrix<T>& mat)
+{
+	typedef accumulator_t<T> Acc;
+	const size_t nChunks = ThreadPool::getInstance()->numThreads() + 1;
+	const size_t step = std::max(size_t(1), (mat.rows() + nChunks - 1) / nChunks);
+	std::vector<std::vector<Acc>> partials((mat.rows() + step - 1) / step, std::vector<Acc>(mat.cols()));
+
+	parallelFor(partials.size(), mat.rows() * mat.cols(), [&mat, &partials, step](const size_t begin, const size_t end)
+	{
+		for (size_t c = begin; c < end; ++c)
+		{
+			Acc* s = partials[c].data();
+			for (size_t i = c * step; i < std::min(mat.rows(), (c + 1) * step); ++i)
+			{
+				const T* ai = mat[i];
+				for (size_t j = 0; j < mat.cols(); ++j) s[j] += static_cast<Acc>(ai[j]);
+			}
+		}
+	});
+
+	std::vector<Acc> res(mat.cols());
+	for (const std::vector<Acc>& p : partials)
+		for (size_t j = 0; j < mat.cols(); ++j) res[j] += p[j];
+	return res;
+}
+
+template <class T>
+std::vector<T> colMax(const matrix<T>& mat)
+{
+	assert(mat.rows() > 0);
+	const size_t nChunks = ThreadPool::getInstance()->numThreads() + 1;
+	const size_t step = (mat.rows() + nChunks - 1) / nChunks;
+	std::vector<std::vector<T>> partials((mat.rows() + step - 1) / step);
+
+	parallelFor(partials.size(), mat.rows() * mat.cols(), [&mat, &partials, step](const size_t begin, const size_t end)
+	{
+		for (size_t c = begin; c < end; ++c)
+		{
+			const size_t i0 = c * step;
+			std::vector<T> m(mat[i0], mat[i0] + mat.cols());
+			for (size_t i = i0 + 1; i < std::min(mat.rows(), i0 + step); ++i)
+			{
+				const T* ai = mat[i];
+				for (size_t j = 0; j < mat.cols(); ++j) m[j] = ai[j] > m[j] ? ai[j] : m[j];
+			}
+			partials[c] = std::move(m);
+		}
+	});
+
+	std::vector<T> res = std::move(partials[0]);
+	for (size_t c = 1; c < partials.size(); ++c)
+		for (size_t j = 0; j < mat.cols(); ++j) res[j] = partials[c][j] > res[j] ? partials[c][j] : res[j];
+	return res;
+}
+
+//  First row index of the max in each column
+template <class T>
+std::vector<size_t> colArgmax(const matrix<T>& mat)
+{
+	assert(mat.rows() > 0);
+	const size_t nChunks = ThreadPool::getInstance()->numThreads() + 1;
+	const size_t step = (mat.rows() + nChunks - 1) / nChunks;
+	const size_t nParts = (mat.rows() + step - 1) / step;
+	std::vector<std::vector<T>> maxes(nParts);
+	std::vector<std::vector<size_t>> args(nParts);
+
+	parallelFor(nParts, mat.rows() * mat.cols(), [&mat, &maxes, &args, step](const size_t begin, const size_t end)
+	{
+		for (size_t c = begin; c < end; ++c)
+		{
+			const size_t i0 = c * step;
+			std::vector<T> m(mat[i0], mat[i0] + mat.cols());
+			std::vector<size_t> k(mat.cols(), i0);
+			for (size_t i = i0 + 1; i < std::min(mat.rows(), i0 + step); ++i)
+			{
+				const T* ai = mat[i];
+				for (size_t j = 0; j < mat.cols(); ++j)
+				{
+					const bool better = ai[j] > m[j];
+					m[j] = better ? ai[j] : m[j];
+					k[j] = better ? i : k[j];
+				}
+			}
+			maxes[c] = std::move(m);
+			args[c] = std::move(k);
+		}
+	});
+
+	//  Strict > keeps the earlier chunk on ties, so the first index wins
+	std::vector<T> m = std::move(maxes[0]);
+	std::vector<size_t> res = std::move(args[0]);
+	for (size_t c = 1; c < nParts; ++c)
+	{
+		for (size_t j = 0; j < mat.cols(); ++j)
+		{
+			if (maxes[c][j] > m[j])
+			{
+				m[j] = maxes[c][j];
+				res[j] = args[c][j];
+			}
+		}
+	}
+	return res;
+}
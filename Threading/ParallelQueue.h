@@ -1,81 +1,247 @@
 #pragma once
 
-#include <queue>
 #include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <new>
+#include <utility>
 //using namespace std;
 
 template <class T>
 class ConcurrentQueue
 {
+	//	Elements live in fixed size chunks, linked from head to tail
+	//	Emptied chunks go to a free list and are reused, so once the queue
+	//	has reached its working size, push and pop no longer allocate
+	//	Chunks never move their elements, T only needs to be constructible
+	static constexpr size_t chunkSize = sizeof(T) >= 256 ? 16 : 4096 / sizeof(T);
+
+	struct chunk
+	{
+		chunk* next;
+		size_t begin;	//	first live element
+		size_t end;		//	one past the last constructed element
+		alignas(T) unsigned char storage[chunkSize * sizeof(T)];
+
+		void* raw(const size_t i) { return storage + i * sizeof(T); }
+		T* slot(const size_t i) { return std::launder(reinterpret_cast<T*>(raw(i))); }
+	};
+
+	chunk* myHead;
+	chunk* myTail;
+	chunk* myFree;
+	size_t mySize;
 
-	std::queue<T> myQueue;
 	mutable std::mutex myMutex;
 	std::condition_variable myCV;
 	bool myInterrupt;
 
+	//	0 for unbounded, otherwise push waits for room
+	const size_t myCapacity;
+	std::condition_variable myNotFull;
+
+	//	All private helpers below expect the lock held
+
+	chunk* newChunk()
+	{
+		chunk* c;
+		if (myFree)
+		{
+			c = myFree;
+			myFree = c->next;
+		}
+		else c = new chunk;
+		c->next = nullptr;
+		c->begin = c->end = 0;
+		return c;
+	}
+
+	void recycle(chunk* c)
+	{
+		c->next = myFree;
+		myFree = c;
+	}
+
+	//	Strong guarantee: if T's constructor throws, the queue is unchanged
+	template <class... Args>
+	void emplaceBack(Args&&... args)
+	{
+		if (!myTail) myHead = myTail = newChunk();
+		else if (myTail->end == chunkSize)
+		{
+			chunk* c = newChunk();
+			myTail->next = c;
+			myTail = c;
+		}
+		new (myTail->raw(myTail->end)) T(std::forward<Args>(args)...);
+		++myTail->end;
+		++mySize;
+	}
+
+	T& front() { return *myHead->slot(myHead->begin); }
+
+	void popFront()
+	{
+		front().~T();
+		++myHead->begin;
+		--mySize;
+		if (myHead->begin == myHead->end)
+		{
+			if (myHead->next)
+			{
+				chunk* c = myHead;
+				myHead = c->next;
+				recycle(c);
+			}
+			//	Last chunk, rewind in place
+			else myHead->begin = myHead->end = 0;
+		}
+	}
+
+	void destroyAll()
+	{
+		while (mySize) popFront();
+	}
+
+	//	After a pop, with the lock released
+	void notifyNotFull()
+	{
+		if (myCapacity) myNotFull.notify_one();
+	}
+
 public:
 
-	ConcurrentQueue() : myInterrupt(false) {}
-	~ConcurrentQueue() { interrupt(); }
+	explicit ConcurrentQueue(const size_t capacity = 0)
+		: myHead(nullptr), myTail(nullptr), myFree(nullptr), mySize(0), myInterrupt(false), myCapacity(capacity) {}
+	~ConcurrentQueue()
+	{
+		interrupt();
+		destroyAll();
+		for (chunk* c : { myHead, myFree })
+		{
+			while (c)
+			{
+				chunk* next = c->next;
+				delete c;
+				c = next;
+			}
+		}
+	}
+
+	//	Non copyable
+	ConcurrentQueue(const ConcurrentQueue&) = delete;
+	ConcurrentQueue& operator=(const ConcurrentQueue&) = delete;
 
 	bool empty() const
 	{
 		//	Lock
 		std::lock_guard<std::mutex> lk(myMutex);
 		//	Access underlying queue
-		return myQueue.empty();
+		return mySize == 0;
 	}	//	Unlock
 
+	size_t size() const
+	{
+		std::lock_guard<std::mutex> lk(myMutex);
+		return mySize;
+	}
+
+	size_t capacity() const { return myCapacity; }
+
 	//	Pop into argument
 	bool tryPop(T& t)
 	{
-		//	Lock
-		std::lock_guard<std::mutex> lk(myMutex);
-		if (myQueue.empty()) return false;
-		//	Move from queue
-		t = std::move(myQueue.front());
-		//	Combine front/pop
-		myQueue.pop();
+		{
+			//	Lock
+			std::lock_guard<std::mutex> lk(myMutex);
+			if (mySize == 0) return false;
+			//	Move from queue
+			t = std::move(front());
+			//	Combine front/pop
+			popFront();
+		}	//	Unlock
 
+		notifyNotFull();
 		return true;
-	}	//	Unlock
+	}
+
+	//	Pop into a new T, no default construction needed
+	std::optional<T> tryPop()
+	{
+		std::unique_lock<std::mutex> lk(myMutex);
+		if (mySize == 0) return std::nullopt;
+		//	If the move throws, the element stays queued
+		std::optional<T> t(std::move(front()));
+		popFront();
+		lk.unlock();
 
-	//	Pass t byVal or move with push( move( t))
-	void push(T t)
+		notifyNotFull();
+		return t;
+	}
+
+	//	Construct in place from args
+	//	When bounded and full, waits for room, false if interrupted meanwhile
+	template <class... Args>
+	bool emplace(Args&&... args)
 	{
 		{
 			//	Lock
-			std::lock_guard<std::mutex> lk(myMutex);
-			//	Move into queue
-			myQueue.push(move(t));
+			std::unique_lock<std::mutex> lk(myMutex);
+			if (myCapacity)
+			{
+				while (!myInterrupt && mySize >= myCapacity) myNotFull.wait(lk);
+				if (mySize >= myCapacity) return false;
+			}
+			emplaceBack(std::forward<Args>(args)...);
 		}	//	Unlock before notification
 
-		//	Unlock before notification 
 		myCV.notify_one();
+		return true;
 	}
 
+	//	Copy or move in, use push( move( t)) to move
+	bool push(const T& t) { return emplace(t); }
+	bool push(T&& t) { return emplace(std::move(t)); }
+
 	//	Wait if empty
 	bool pop(T& t)
 	{
 		//	(Unique) lock
 		std::unique_lock<std::mutex> lk(myMutex);
 
-		//	Wait if empty, release lock until notified 
-		while (!myInterrupt && myQueue.empty()) myCV.wait(lk);
+		//	Wait if empty, release lock until notified
+		while (!myInterrupt && mySize == 0) myCV.wait(lk);
 
-		//	Re-acquire lock, resume 
+		//	Re-acquire lock, resume
 
 		//  Check for interruption
 		if (myInterrupt) return false;
 
-		//	Combine front/pop 
-		t = std::move(myQueue.front());
-		myQueue.pop();
+		//	Combine front/pop
+		t = std::move(front());
+		popFront();
+		lk.unlock();
 
+		notifyNotFull();
 		return true;
+	}
 
-	}	//	Unlock
+	//	Wait if empty, nullopt when interrupted
+	std::optional<T> pop()
+	{
+		std::unique_lock<std::mutex> lk(myMutex);
+		while (!myInterrupt && mySize == 0) myCV.wait(lk);
+		if (myInterrupt) return std::nullopt;
+
+		std::optional<T> t(std::move(front()));
+		popFront();
+		lk.unlock();
+
+		notifyNotFull();
+		return t;
+	}
 
+	//	Wakes up every pop, and every push waiting for room
 	void interrupt()
 	{
 		{
@@ -83,16 +249,22 @@ public:
 			myInterrupt = true;
 		}
 		myCV.notify_all();
+		myNotFull.notify_all();
 	}
 
 	void resetInterrupt()
 	{
+		std::lock_guard<std::mutex> lk(myMutex);
 		myInterrupt = false;
 	}
 
+	//	Chunks are kept for reuse
 	void clear()
 	{
-		std::queue<T> empty;
-		swap(myQueue, empty);
+		{
+			std::lock_guard<std::mutex> lk(myMutex);
+			destroyAll();
+		}
+		myNotFull.notify_all();
 	}
-};
\ No newline at end of file
+};
@@ -0,0 +1,535 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <assert.h>
+#include "ParallelQueue.h"
+
+//  Multi-stage pipelines of threads linked by bounded ConcurrentQueues
+//
+//      pipeline<std::string> p(64);                                //  input packed 64 items per packet
+//      auto q = std::move(p)
+//          .then("parse", [](std::string s) { return parse(s); }, stageOptions(4))
+//          .then("price", [](trade t) { return price(t); }, stageOptions(8, false));
+//      q.start();
+//      q.push(line); ...; q.close();                               //  producer side
+//      while (std::optional<double> v = q.pop()) ...               //  consumer side
+//
+//  Items travel in packets (vectors of items) to amortize the queue locks over a batch.
+//  Each stage runs its own threads, each popping a packet, applying the function to every
+//  item, and passing the results on. An ordered stage re-sequences packets before passing
+//  them on, so its output keeps the input order whatever its parallelism.
+//  Queues are bounded (in packets), a stage that outruns the next one blocks: backpressure.
+//  An ordered stage also holds at most capacity packets of results waiting for their turn:
+//  a thread only starts on a packet within capacity of the next one due, so one slow
+//  packet stalls its siblings instead of growing the reorder buffer without limit.
+//
+//  close() drains: the end of stream travels down behind the last items.
+//  interrupt() stops now, through ConcurrentQueue::interrupt on every queue.
+//  A stage function that throws interrupts the pipeline the same way: push then returns
+//  false, and pop and wait rethrow the first exception.
+//  stats() tells, per stage, the share of its threads' time spent working: the stage
+//  closest to 100% is the bottleneck, and the one to widen.
+
+struct stageOptions
+{
+	size_t  parallelism = 1;    //  threads
+	bool    ordered = true;     //  output in input order
+	size_t  batch = 64;         //  items per output packet
+	size_t  capacity = 16;      //  output queue size, in packets
+
+	stageOptions() {}
+	explicit stageOptions(const size_t threads, const bool inOrder = true, const size_t batchSize = 64, const size_t queueSize = 16)
+		: parallelism(std::max(size_t(1), threads)), ordered(inOrder), batch(std::max(size_t(1), batchSize)), capacity(std::max(size_t(1), queueSize)) {}
+};
+
+//  Throughput of one stage, times in seconds
+struct stageStats
+{
+	std::string name;
+	size_t      parallelism;
+	uint64_t    itemsIn;
+	uint64_t    itemsOut;
+	double      elapsed;        //  since start(), or until the stage finished
+	double      busy;           //  running the function, summed over threads
+	double      starved;        //  waiting for input
+	double      blocked;        //  waiting for room downstream, or for its turn when ordered
+	size_t      reorderPeak;    //  ordered: most packets of results held for their turn
+
+	double throughput() const { return elapsed > 0 ? itemsOut / elapsed : 0; }
+	double utilization() const { return elapsed > 0 ? busy / (elapsed * parallelism) : 0; }
+};
+
+//  Unit of transfer between stages
+template <class T>
+struct pipelinePacket
+{
+	uint64_t        seq = 0;
+	std::vector<T>  items;
+	bool            last = false;   //  end of stream, always empty
+};
+
+template <class T>
+using pipelineQueue = ConcurrentQueue<pipelinePacket<T>>;
+
+class pipelineStageBase
+{
+public:
+	virtual ~pipelineStageBase() {}
+	virtual void start() = 0;
+	virtual void interrupt() = 0;
+	virtual void join() = 0;
+	virtual stageStats stats() const = 0;
+};
+
+//  Stages of one pipeline, and its first failure
+struct pipelineCoreBase
+{
+	std::vector<std::unique_ptr<pipelineStageBase>> stages;
+
+	std::mutex                                      errorMutex;
+	std::exception_ptr                              error;
+
+	virtual ~pipelineCoreBase() {}
+	virtual void interruptInput() = 0;
+
+	void interruptAll()
+	{
+		//  Queues first, a producer blocked in push holds the input lock
+		interruptInput();
+		for (auto& s : stages) s->interrupt();
+	}
+
+	//  From a stage thread: keeps the first exception and stops everything
+	void fail(std::exception_ptr e)
+	{
+		{
+			std::lock_guard<std::mutex> lk(errorMutex);
+			if (!error) error = e;
+		}
+		interruptAll();
+	}
+
+	void rethrow()
+	{
+		std::exception_ptr e;
+		{
+			std::lock_guard<std::mutex> lk(errorMutex);
+			e = error;
+		}
+		if (e) std::rethrow_exception(e);
+	}
+};
+
+template <class In, class Out, class F>
+class pipelineStage : public pipelineStageBase
+{
+	typedef std::chrono::steady_clock clock;
+
+	pipelineCoreBase&                   myCore;
+	const std::string                   myName;
+	F                                   myF;
+	const stageOptions                  myOpt;
+	std::shared_ptr<pipelineQueue<In>>  myIn;
+	std::shared_ptr<pipelineQueue<Out>> myOut;
+	std::vector<std::thread>            myThreads;
+	std::atomic<size_t>                 myRunning;
+
+	//  Output side, under myEmitMutex
+	mutable std::mutex                  myEmitMutex;
+	std::condition_variable             myWindow;       //  ordered: myNextIn moved, or interrupted
+	bool                                myInterrupted;
+	std::map<uint64_t, std::vector<Out>> myReorder;    //  ordered: results ahead of their turn
+	uint64_t                            myNextIn;       //  ordered: next input packet to pass on
+	std::vector<Out>                    myPending;      //  partial output packet
+	uint64_t                            myNextOut;
+
+	//  Stats, in ns
+	std::atomic<uint64_t>               myItemsIn;
+	std::atomic<uint64_t>               myItemsOut;
+	std::atomic<uint64_t>               myBusy;
+	std::atomic<uint64_t>               myStarved;
+	std::atomic<uint64_t>               myBlocked;
+	size_t                              myReorderPeak;  //  under myEmitMutex
+	clock::time_point                   myStart;
+	std::atomic<int64_t>                myEnd;          //  ns after myStart, 0 while running
+
+	static uint64_t since(const clock::time_point t0)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t0).count();
+	}
+
+	//  Expects myEmitMutex held
+	void send(const bool last)
+	{
+		pipelinePacket<Out> p;
+		p.seq = myNextOut++;
+		p.items.swap(myPending);
+		p.last = last;
+		myItemsOut += p.items.size();
+
+		const clock::time_point t0 = clock::now();
+		myOut->push(std::move(p));
+		myBlocked += since(t0);
+		myPending.reserve(myOpt.batch);
+	}
+
+	void append(std::vector<Out>& results)
+	{
+		for (Out& r : results)
+		{
+			myPending.push_back(std::move(r));
+			if (myPending.size() >= myOpt.batch) send(false);
+		}
+	}
+
+	void emit(const uint64_t seq, std::vector<Out> results)
+	{
+		std::lock_guard<std::mutex> lk(myEmitMutex);
+		if (!myOpt.ordered)
+		{
+			append(results);
+			return;
+		}
+
+		myReorder.emplace(seq, std::move(results));
+		myReorderPeak = std::max(myReorderPeak, myReorder.size());
+		const uint64_t before = myNextIn;
+		for (auto it = myReorder.begin(); it != myReorder.end() && it->first == myNextIn; it = myReorder.erase(it), ++myNextIn)
+			append(it->second);
+		if (myNextIn != before) myWindow.notify_all();
+	}
+
+	//  Ordered: wait until packet seq is within capacity of the next one due, false if interrupted
+	//  The packet due is always in, so some thread always makes progress
+	bool enterWindow(const uint64_t seq)
+	{
+		if (!myOpt.ordered) return true;
+		std::unique_lock<std::mutex> lk(myEmitMutex);
+		if (seq < myNextIn + myOpt.capacity) return true;
+		const clock::time_point t0 = clock::now();
+		myWindow.wait(lk, [this, seq] { return myInterrupted || seq < myNextIn + myOpt.capacity; });
+		myBlocked += since(t0);
+		return !myInterrupted;
+	}
+
+	//  Last thread out flushes and passes the end of stream on
+	void finish()
+	{
+		std::lock_guard<std::mutex> lk(myEmitMutex);
+		if (!myPending.empty()) send(false);
+		send(true);
+		myEnd = since(myStart);
+	}
+
+	void work()
+	{
+		pipelinePacket<In> p;
+		while (true)
+		{
+			const clock::time_point t0 = clock::now();
+			if (!myIn->pop(p)) break;
+			myStarved += since(t0);
+
+			//  Each thread sees the end of stream once, all but the last put it back for
+			//  their siblings, and the last one passes it on: nothing is left behind in myIn
+			if (p.last)
+			{
+				if (--myRunning == 0) finish();
+				else myIn->push(std::move(p));
+				return;
+			}
+
+			if (!enterWindow(p.seq)) break;
+
+			myItemsIn += p.items.size();
+			std::vector<Out> results;
+			results.reserve(p.items.size());
+			const clock::time_point t1 = clock::now();
+			try
+			{
+				for (In& x : p.items) results.push_back(myF(std::move(x)));
+			}
+			catch (...)
+			{
+				myBusy += since(t1);
+				myCore.fail(std::current_exception());
+				break;
+			}
+			myBusy += since(t1);
+
+			emit(p.seq, std::move(results));
+		}
+
+		//  Interrupted, or failed
+		if (--myRunning == 0) myEnd = since(myStart);
+	}
+
+public:
+
+	pipelineStage(pipelineCoreBase& core, const std::string& name, F f, const stageOptions& opt,
+		std::shared_ptr<pipelineQueue<In>> in, std::shared_ptr<pipelineQueue<Out>> out)
+		: myCore(core), myName(name), myF(std::move(f)), myOpt(opt), myIn(in), myOut(out), myRunning(0),
+		myInterrupted(false), myNextIn(0), myNextOut(0), myItemsIn(0), myItemsOut(0), myBusy(0), myStarved(0), myBlocked(0), myReorderPeak(0), myEnd(0) {}
+
+	~pipelineStage()
+	{
+		interrupt();
+		join();
+	}
+
+	void start() override
+	{
+		myStart = clock::now();
+		myRunning = myOpt.parallelism;
+		myPending.reserve(myOpt.batch);
+		myThreads.resize(myOpt.parallelism);
+		for (std::thread& t : myThreads) t = std::thread(&pipelineStage::work, this);
+	}
+
+	void interrupt() override
+	{
+		myIn->interrupt();
+		myOut->interrupt();
+		{
+			std::lock_guard<std::mutex> lk(myEmitMutex);
+			myInterrupted = true;
+		}
+		myWindow.notify_all();
+	}
+
+	void join() override
+	{
+		for (std::thread& t : myThreads) if (t.joinable()) t.join();
+	}
+
+	stageStats stats() const override
+	{
+		const int64_t end = myEnd.load();
+		stageStats s;
+		s.name = myName;
+		s.parallelism = myOpt.parallelism;
+		s.itemsIn = myItemsIn;
+		s.itemsOut = myItemsOut;
+		s.elapsed = (end ? end : since(myStart)) * 1e-9;
+		s.busy = myBusy * 1e-9;
+		s.starved = myStarved * 1e-9;
+		s.blocked = myBlocked * 1e-9;
+		{
+			std::lock_guard<std::mutex> lk(myEmitMutex);
+			s.reorderPeak = myReorderPeak;
+		}
+		return s;
+	}
+};
+
+//  Stages and state shared by the successive pipeline<In, ...> types of one build
+template <class In>
+struct pipelineCore : pipelineCoreBase
+{
+	std::shared_ptr<pipelineQueue<In>>              input;
+	bool                                            started = false;
+
+	//  Producer side, under inputMutex
+	std::mutex                                      inputMutex;
+	size_t                                          inputBatch;
+	std::vector<In>                                 inputPending;
+	uint64_t                                        inputSeq = 0;
+	bool                                            closed = false;
+
+	void interruptInput() override { if (input) input->interrupt(); }
+
+	//  Join every stage before destroying any, a failing one still reaches the others,
+	//  then the stages go before the queues
+	~pipelineCore()
+	{
+		interruptAll();
+		for (auto& s : stages) s->join();
+		stages.clear();
+	}
+};
+
+//  In is what goes in, Out what comes out of the last stage
+template <class In, class Out = In>
+class pipeline
+{
+	template <class, class> friend class pipeline;
+
+	std::shared_ptr<pipelineCore<In>>   myCore;
+	std::shared_ptr<pipelineQueue<Out>> myOutput;
+
+	//  Consumer side
+	std::shared_ptr<std::mutex>         myOutputMutex;
+	std::vector<Out>                    myOutputItems;
+	size_t                              myOutputNext;
+	bool                                myDone;
+
+	pipeline(std::shared_ptr<pipelineCore<In>> core, std::shared_ptr<pipelineQueue<Out>> output)
+		: myCore(core), myOutput(output), myOutputMutex(new std::mutex), myOutputNext(0), myDone(false) {}
+
+	//  Expects inputMutex held, false if interrupted
+	bool sendInput(const bool last)
+	{
+		pipelinePacket<In> p;
+		p.seq = myCore->inputSeq++;
+		p.items.swap(myCore->inputPending);
+		p.last = last;
+		const bool pushed = myCore->input->push(std::move(p));
+		myCore->inputPending.reserve(myCore->inputBatch);
+		return pushed;
+	}
+
+	//  Hand the next output item to out(Out&&), false at the end of stream or interrupted
+	//  Rethrows a stage's exception
+	template <class Sink>
+	bool next(Sink out)
+	{
+		std::lock_guard<std::mutex> lk(*myOutputMutex);
+		while (myOutputNext == myOutputItems.size())
+		{
+			if (myDone) return false;
+			pipelinePacket<Out> p;
+			if (!myOutput->pop(p))
+			{
+				myCore->rethrow();
+				return false;
+			}
+			if (p.last) myDone = true;
+			myOutputItems.swap(p.items);
+			myOutputNext = 0;
+		}
+		out(std::move(myOutputItems[myOutputNext++]));
+		return true;
+	}
+
+public:
+
+	//  Pipeline with no stage yet, input packed batch items per packet,
+	//  at most capacity packets queued before push blocks
+	explicit pipeline(const size_t batch = 64, const size_t capacity = 16)
+		: myCore(new pipelineCore<In>), myOutputMutex(new std::mutex), myOutputNext(0), myDone(false)
+	{
+		static_assert(std::is_same<In, Out>::value, "start from pipeline<In>");
+		myCore->input = std::make_shared<pipelineQueue<In>>(std::max(size_t(1), capacity));
+		myCore->inputBatch = std::max(size_t(1), batch);
+		myOutput = myCore->input;
+	}
+
+	pipeline(pipeline&&) = default;
+	pipeline& operator=(pipeline&&) = default;
+
+	//  Appends a stage running f(Out) -> R, returns the extended pipeline
+	//  This one is left empty
+	template <class F>
+	auto then(const std::string& name, F f, const stageOptions& opt = stageOptions()) &&
+	{
+		typedef std::decay_t<decltype(f(std::declval<Out>()))> R;
+		assert(!myCore->started);
+
+		auto out = std::make_shared<pipelineQueue<R>>(opt.capacity);
+		myCore->stages.push_back(std::unique_ptr<pipelineStageBase>(
+			new pipelineStage<Out, R, F>(*myCore, name, std::move(f), opt, myOutput, out)));
+		return pipeline<In, R>(std::move(myCore), out);
+	}
+
+	void start()
+	{
+		if (myCore->started) return;
+		myCore->started = true;
+		for (auto& s : myCore->stages) s->start();
+	}
+
+	//  Producer side, any number of threads
+	//  Blocks when the first stage is behind, false once closed, interrupted or failed
+	bool push(In t)
+	{
+		std::lock_guard<std::mutex> lk(myCore->inputMutex);
+		if (myCore->closed) return false;
+		myCore->inputPending.push_back(std::move(t));
+		if (myCore->inputPending.size() >= myCore->inputBatch) return sendInput(false);
+		return true;
+	}
+
+	//  End of input, the stages finish what is queued and then stop
+	void close()
+	{
+		std::lock_guard<std::mutex> lk(myCore->inputMutex);
+		if (myCore->closed) return;
+		myCore->closed = true;
+		if (!myCore->inputPending.empty()) sendInput(false);
+		sendInput(true);
+	}
+
+	//  Consumer side, false once everything is out, or interrupted
+	//  Throws what a stage threw
+	bool pop(Out& t) { return next([&t](Out&& v) { t = std::move(v); }); }
+
+	std::optional<Out> pop()
+	{
+		std::optional<Out> t;
+		next([&t](Out&& v) { t.emplace(std::move(v)); });
+		return t;
+	}
+
+	//  Immediate stop, queued items are dropped
+	void interrupt()
+	{
+		myCore->interruptAll();
+		std::lock_guard<std::mutex> lk(myCore->inputMutex);
+		myCore->closed = true;
+	}
+
+	//  Joins the stage threads, after close() and draining the output, or interrupt()
+	//  Then throws what a stage threw, if any
+	void wait()
+	{
+		for (auto& s : myCore->stages) s->join();
+		myCore->rethrow();
+	}
+
+	std::vector<stageStats> stats() const
+	{
+		std::vector<stageStats> res;
+		for (const auto& s : myCore->stages) res.push_back(s->stats());
+		return res;
+	}
+
+	//  One line per stage, the most utilized marked as the bottleneck
+	void report(std::ostream& os) const
+	{
+		const std::vector<stageStats> st = stats();
+		size_t worst = 0;
+		for (size_t i = 1; i < st.size(); ++i)
+			if (st[i].utilization() > st[worst].utilization()) worst = i;
+
+		const std::ios_base::fmtflags flags = os.flags();
+		const std::streamsize precision = os.precision();
+		os << std::left << std::setw(16) << "stage" << std::right << std::setw(8) << "threads"
+			<< std::setw(12) << "items" << std::setw(14) << "items/s" << std::setw(8) << "busy"
+			<< std::setw(12) << "starved s" << std::setw(12) << "blocked s" << "\n";
+		for (size_t i = 0; i < st.size(); ++i)
+		{
+			const stageStats& s = st[i];
+			os << std::left << std::setw(16) << s.name << std::right << std::setw(8) << s.parallelism
+				<< std::setw(12) << s.itemsOut << std::setw(14) << std::fixed << std::setprecision(0) << s.throughput()
+				<< std::setw(7) << std::setprecision(0) << s.utilization() * 100 << "%"
+				<< std::setw(12) << std::setprecision(3) << s.starved << std::setw(12) << s.blocked
+				<< (i == worst ? "  <- bottleneck" : "") << "\n";
+		}
+		os.flags(flags);
+		os.precision(precision);
+	}
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+//  Number types and compile-time traits for mixed precision products
+
+//  16 bit storage formats, arithmetic goes through float
+//  Conversions are explicit so narrowing is always visible at the call site
+
+//  bfloat16: top half of an IEEE float, same range, 8 bit mantissa
+struct bfloat16
+{
+	uint16_t bits;
+
+	bfloat16() : bits(0) {}
+	explicit bfloat16(const float f)
+	{
+		uint32_t u;
+		std::memcpy(&u, &f, sizeof(u));
+		//  Keep NaNs quiet, otherwise round to nearest even
+		if ((u & 0x7FFFFFFF) > 0x7F800000) bits = static_cast<uint16_t>((u >> 16) | 0x40);
+		else bits = static_cast<uint16_t>((u + 0x7FFF + ((u >> 16) & 1)) >> 16);
+	}
+	explicit bfloat16(const double d) : bfloat16(static_cast<float>(d)) {}
+
+	operator float() const
+	{
+		const uint32_t u = static_cast<uint32_t>(bits) << 16;
+		float f;
+		std::memcpy(&f, &u, sizeof(f));
+		return f;
+	}
+};
+
+//  IEEE half: 5 bit exponent, 10 bit mantissa
+struct half
+{
+	uint16_t bits;
+
+	half() : bits(0) {}
+	explicit half(const float f)
+	{
+		uint32_t u;
+		std::memcpy(&u, &f, sizeof(u));
+		const uint32_t sign = (u >> 16) & 0x8000;
+		const uint32_t absu = u & 0x7FFFFFFF;
+
+		//  Inf and NaN
+		if (absu >= 0x7F800000) bits = static_cast<uint16_t>(sign | (absu > 0x7F800000 ? 0x7E00 : 0x7C00));
+		//  Rounds above 65504
+		else if (absu >= 0x477FF000) bits = static_cast<uint16_t>(sign | 0x7C00);
+		//  Subnormal half, below 2^-14
+		else if (absu < 0x38800000)
+		{
+			if (absu < 0x33000000) { bits = static_cast<uint16_t>(sign); return; }
+			const uint32_t mant = (absu & 0x7FFFFF) | 0x800000;
+			const uint32_t shift = 126 - (absu >> 23);
+			uint32_t r = mant >> shift;
+			const uint32_t rem = mant & ((1u << shift) - 1);
+			const uint32_t halfway = 1u << (shift - 1);
+			if (rem > halfway || (rem == halfway && (r & 1))) ++r;
+			bits = static_cast<uint16_t>(sign | r);
+		}
+		//  Normal, rebias exponent and round to nearest even
+		else
+		{
+			uint32_t r = (absu - 0x38000000) >> 13;
+			const uint32_t rem = absu & 0x1FFF;
+			if (rem > 0x1000 || (rem == 0x1000 && (r & 1))) ++r;
+			bits = static_cast<uint16_t>(sign | r);
+		}
+	}
+	explicit half(const double d) : half(static_cast<float>(d)) {}
+
+	operator float() const
+	{
+		const uint32_t sign = static_cast<uint32_t>(bits & 0x8000) << 16;
+		const uint32_t e = (bits >> 10) & 0x1F;
+		const uint32_t m = bits & 0x3FF;
+		if (e == 0)
+		{
+			const float f = std::ldexp(static_cast<float>(m), -24);
+			return sign ? -f : f;
+		}
+		const uint32_t u = e == 31
+			? sign | 0x7F800000 | (m << 13)
+			: sign | ((e + 112) << 23) | (m << 13);
+		float f;
+		std::memcpy(&f, &u, sizeof(f));
+		return f;
+	}
+};
+
+//  Accumulator used by the products for a given element type
+//  Specialize to change the default, or pass Acc explicitly to the product
+template <class T>
+struct accumulator
+{
+	typedef T type;
+};
+
+template <> struct accumulator<int8_t> { typedef int32_t type; };
+template <> struct accumulator<uint8_t> { typedef int32_t type; };
+template <> struct accumulator<int16_t> { typedef int32_t type; };
+template <> struct accumulator<bfloat16> { typedef float type; };
+template <> struct accumulator<half> { typedef float type; };
+
+template <class T>
+using accumulator_t = typename accumulator<T>::type;
+
+//  Conversion of one element, saturating when To is an integer
+//  Results accumulated wide come back into range instead of wrapping:
+//  an int8_t product of 30000 narrows to 127, not 48
+//  Floating targets convert as is, bfloat16 keeps the float range and half rounds to inf
+template <class To, class From>
+inline To narrowCast(const From x)
+{
+	typedef std::numeric_limits<To> lim;
+	if constexpr (!std::is_integral<To>::value || std::is_same<To, From>::value) return static_cast<To>(x);
+	else if constexpr (!std::is_integral<From>::value)
+	{
+		const double d = static_cast<double>(x);
+		if (d != d) return To(0);
+		return d <= double(lim::min()) ? lim::min() : d >= double(lim::max()) ? lim::max() : static_cast<To>(d);
+	}
+	else
+	{
+		if constexpr (std::is_signed<From>::value)
+		{
+			if (x < 0) return intmax_t(x) < intmax_t(lim::min()) ? lim::min() : static_cast<To>(x);
+		}
+		return uintmax_t(x) > uintmax_t(lim::max()) ? lim::max() : static_cast<To>(x);
+	}
+}
+
+//  Element-wise conversion as a flat indexed loop
+//  No aliasing and no calls, so the compiler emits packed widen/narrow instructions
+//  (the saturation in narrowCast is a min and a max)
+template <class To, class From>
+inline void convertRange(const From* src, const size_t n, To* dst)
+{
+	for (size_t i = 0; i < n; ++i)
+		dst[i] = narrowCast<To>(src[i]);
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include "SpinWait.h"
+#include "AdaptiveMutex.h"
+
+//  Priority and deadline aware queue, with the ConcurrentQueue interface
+//
+//  Level 0 is the most urgent. pop() serves the most urgent non-empty level, and within
+//  a level the earliest deadline first, items without a deadline after those in push order.
+//  Each level is its own heap behind its own adaptiveMutex, so producers at different
+//  levels never contend, and consumers skip empty levels without locking them.
+//
+//  Aging: once per agingInterval, a popping thread moves every item that has waited
+//  that long, or whose deadline is that close, up one level, but never above the aging
+//  limit (level 0 by default). A stream of more urgent work delays an item by at most
+//  levels() intervals before it competes at the limit. On its way up, an aged item queues
+//  behind the items pushed at its new level, it only overtakes those of the level it came
+//  from. At the limit it competes with fresh items as if pushed there, by deadline then
+//  push order, so a continuous stream at the limit cannot starve it.
+//
+//  Reservations: pop(t, maxLevel) only serves levels 0..maxLevel, so workers popping
+//  with a low maxLevel stay free for urgent work while the others drain the batch jobs.
+//  Set the aging limit below the reserved levels, setAgingLimit(maxLevel + 1), so that
+//  aged batch work never reaches the reserved workers.
+
+template <class T>
+class schedulingQueue
+{
+public:
+
+	typedef std::chrono::steady_clock clock;
+	static constexpr clock::time_point noDeadline = clock::time_point::max();
+
+private:
+
+	struct entry
+	{
+		T                   value;
+		clock::time_point   deadline;
+		clock::time_point   enqueued;
+		uint64_t            seq;
+		size_t              rank;       //  level pushed at, or the aging limit once aged to it
+	};
+
+	//  std heaps keep the greatest on top, so "greater" here means served later
+	//  Items pushed at the level first, then those aged into it, each by EDF then push order
+	static bool later(const entry& a, const entry& b)
+	{
+		if (a.rank != b.rank) return a.rank > b.rank;
+		return a.deadline != b.deadline ? a.deadline > b.deadline : a.seq > b.seq;
+	}
+
+	struct alignas(cacheLineSize) level
+	{
+		adaptiveMutex           mutex;
+		std::vector<entry>      heap;
+		std::atomic<size_t>     count{ 0 };    //  heap.size(), readable without the lock
+	};
+
+	const size_t                myLevels;
+	const size_t                myDefault;
+	const clock::duration       myAging;
+	std::unique_ptr<level[]>    myHeaps;
+
+	std::atomic<uint64_t>       mySeq;
+	std::atomic<size_t>         mySize;
+	std::atomic<int64_t>        myNextAging;   //  in clock ticks
+	std::atomic<size_t>         myAgingLimit;  //  most urgent level aging moves items to
+
+	//  Sleeping consumers wait on the epoch, bumped by every push and by interrupt
+	std::atomic<uint32_t>       myEpoch;
+	std::atomic<uint32_t>       myWaiters;
+	std::atomic<bool>           myInterrupt;
+
+	template <class... Args>
+	void emplaceAt(const size_t priority, const clock::time_point deadline, Args&&... args)
+	{
+		assert(priority < myLevels);
+		const clock::time_point now = clock::now();
+		level& l = myHeaps[priority];
+		{
+			std::lock_guard<adaptiveMutex> lk(l.mutex);
+			l.heap.push_back(entry{ T(std::forward<Args>(args)...), deadline, now, mySeq.fetch_add(1, std::memory_order_relaxed), priority });
+			std::push_heap(l.heap.begin(), l.heap.end(), later);
+			l.count.store(l.heap.size(), std::memory_order_relaxed);
+		}
+		++mySize;
+
+		//  Pairs with the waiters' increment then epoch re-check in pop()
+		myEpoch.fetch_add(1);
+		//  All, as the first one woken may be reserved for a more urgent level
+		if (myWaiters.load()) futexWakeAll(myEpoch);
+	}
+
+	//  Hand the next item among levels 0..maxLevel to out(T&&), if any
+	template <class Out>
+	bool take(Out out, const size_t maxLevel)
+	{
+		maybeAge();
+		for (size_t p = 0; p <= std::min(maxLevel, myLevels - 1); ++p)
+		{
+			level& l = myHeaps[p];
+			if (l.count.load(std::memory_order_relaxed) == 0) continue;
+
+			std::lock_guard<adaptiveMutex> lk(l.mutex);
+			if (l.heap.empty()) continue;
+			std::pop_heap(l.heap.begin(), l.heap.end(), later);
+			out(std::move(l.heap.back().value));
+			l.heap.pop_back();
+			l.count.store(l.heap.size(), std::memory_order_relaxed);
+			--mySize;
+			return true;
+		}
+		return false;
+	}
+
+	//  Blocking take, false when interrupted
+	template <class Out>
+	bool wait(Out out, const size_t maxLevel)
+	{
+		while (true)
+		{
+			const uint32_t e = myEpoch.load();
+			if (myInterrupt.load()) return false;
+			if (take(out, maxLevel)) return true;
+
+			++myWaiters;
+			//  A push after our check has bumped the epoch by now, or sees us waiting
+			if (myEpoch.load() == e) futexWait(myEpoch, e);
+			--myWaiters;
+		}
+	}
+
+	//  At most one thread ages per interval, the others return at once
+	void maybeAge()
+	{
+		if (myLevels < 2) return;
+		const clock::time_point now = clock::now();
+		int64_t next = myNextAging.load(std::memory_order_relaxed);
+		if (now.time_since_epoch().count() < next) return;
+		if (!myNextAging.compare_exchange_strong(next, (now + myAging).time_since_epoch().count(), std::memory_order_relaxed)) return;
+
+		//  Top down, so that an item moves one level per sweep
+		const size_t limit = myAgingLimit.load(std::memory_order_relaxed);
+		for (size_t p = limit + 1; p < myLevels; ++p)
+		{
+			level& from = myHeaps[p];
+			if (from.count.load(std::memory_order_relaxed) == 0) continue;
+			level& to = myHeaps[p - 1];
+
+			std::scoped_lock lk(to.mutex, from.mutex);
+			auto aged = std::partition(from.heap.begin(), from.heap.end(), [this, now](const entry& e)
+			{
+				return e.enqueued + myAging > now && (e.deadline == noDeadline || e.deadline > now + myAging);
+			});
+			if (aged == from.heap.end()) continue;
+
+			for (auto it = aged; it != from.heap.end(); ++it)
+			{
+				it->enqueued = now;
+				//  Arrived: from here on, ranked with the items pushed at the limit
+				if (p - 1 == limit) it->rank = limit;
+				to.heap.push_back(std::move(*it));
+				std::push_heap(to.heap.begin(), to.heap.end(), later);
+			}
+			from.heap.erase(aged, from.heap.end());
+			std::make_heap(from.heap.begin(), from.heap.end(), later);
+			from.count.store(from.heap.size(), std::memory_order_relaxed);
+			to.count.store(to.heap.size(), std::memory_order_relaxed);
+		}
+	}
+
+public:
+
+	//  push() without a priority goes to defaultLevel
+	explicit schedulingQueue(
+		const size_t levels = 4,
+		const size_t defaultLevel = 2,
+		const clock::duration agingInterval = std::chrono::milliseconds(100))
+		: myLevels(std::max(size_t(1), levels)), myDefault(std::min(defaultLevel, myLevels - 1)), myAging(agingInterval),
+		myHeaps(new level[myLevels]), mySeq(0), mySize(0),
+		myNextAging((clock::now() + agingInterval).time_since_epoch().count()), myAgingLimit(0),
+		myEpoch(0), myWaiters(0), myInterrupt(false) {}
+
+	~schedulingQueue() { interrupt(); }
+
+	//  Non copyable
+	schedulingQueue(const schedulingQueue&) = delete;
+	schedulingQueue& operator=(const schedulingQueue&) = delete;
+
+	size_t levels() const { return myLevels; }
+
+	//  Aging stops at level, items pushed above it are unaffected
+	void setAgingLimit(const size_t level) { myAgingLimit = std::min(level, myLevels - 1); }
+	size_t agingLimit() const { return myAgingLimit.load(); }
+	size_t size() const { return mySize.load(); }
+	bool empty() const { return size() == 0; }
+
+	//  ConcurrentQueue interface, at the default level without a deadline
+
+	template <class... Args>
+	void emplace(Args&&... args) { emplaceAt(myDefault, noDeadline, std::forward<Args>(args)...); }
+	void push(const T& t) { emplaceAt(myDefault, noDeadline, t); }
+	void push(T&& t) { emplaceAt(myDefault, noDeadline, std::move(t)); }
+
+	//  With a priority level, and optionally a deadline
+
+	void push(const T& t, const size_t priority, const clock::time_point deadline = noDeadline) { emplaceAt(priority, deadline, t); }
+	void push(T&& t, const size_t priority, const clock::time_point deadline = noDeadline) { emplaceAt(priority, deadline, std::move(t)); }
+
+	//  Pop into argument, serving levels 0..maxLevel only
+	bool tryPop(T& t, const size_t maxLevel) { return take([&t](T&& v) { t = std::move(v); }, maxLevel); }
+	bool tryPop(T& t) { return tryPop(t, myLevels - 1); }
+
+	//  Pop into a new T, no default construction needed
+	std::optional<T> tryPop()
+	{
+		std::optional<T> t;
+		take([&t](T&& v) { t.emplace(std::move(v)); }, myLevels - 1);
+		return t;
+	}
+
+	//  Wait until an item of level 0..maxLevel comes, false when interrupted
+	bool pop(T& t, const size_t maxLevel) { return wait([&t](T&& v) { t = std::move(v); }, maxLevel); }
+	bool pop(T& t) { return pop(t, myLevels - 1); }
+
+	//  Wait if empty, nullopt when interrupted
+	std::optional<T> pop()
+	{
+		std::optional<T> t;
+		wait([&t](T&& v) { t.emplace(std::move(v)); }, myLevels - 1);
+		return t;
+	}
+
+	void interrupt()
+	{
+		myInterrupt = true;
+		myEpoch.fetch_add(1);
+		futexWakeAll(myEpoch);
+	}
+
+	void resetInterrupt() { myInterrupt = false; }
+
+	void clear()
+	{
+		for (size_t p = 0; p < myLevels; ++p)
+		{
+			level& l = myHeaps[p];
+			std::lock_guard<adaptiveMutex> lk(l.mutex);
+			mySize -= l.heap.size();
+			l.heap.clear();
+			l.count.store(0, std::memory_order_relaxed);
+		}
+	}
+};
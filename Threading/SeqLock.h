@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include "SpinWait.h"
+
+//  Sequence lock: readers never block writers or each other
+//
+//  Writers (serialized externally, e.g. by a mutex) make the counter odd while
+//  they modify the data and even again afterwards. A reader notes the counter,
+//  reads, and retries if the counter was odd or moved in the meantime.
+//  The protected data must itself be atomics accessed with relaxed order,
+//  otherwise the torn reads that get retried are formally data races.
+//
+//  Reader:
+//      uint64_t s;
+//      do { s = lock.readBegin(); x = data.load(std::memory_order_relaxed); } while (lock.readRetry(s));
+//
+//  Writer, holding the writer mutex:
+//      lock.writeBegin(); data.store(x, std::memory_order_relaxed); lock.writeEnd();
+
+class seqLock
+{
+	std::atomic<uint64_t> mySeq;
+
+public:
+
+	seqLock() : mySeq(0) {}
+
+	//  Non copyable
+	seqLock(const seqLock&) = delete;
+	seqLock& operator=(const seqLock&) = delete;
+
+	//  Waits out a write in progress, writes are a few stores so this is short
+	uint64_t readBegin() const
+	{
+		uint64_t s = mySeq.load(std::memory_order_acquire);
+		while (s & 1)
+		{
+			cpuRelax();
+			s = mySeq.load(std::memory_order_acquire);
+		}
+		return s;
+	}
+
+	//  True if the reads since readBegin(s) may be inconsistent
+	bool readRetry(const uint64_t s) const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return mySeq.load(std::memory_order_relaxed) != s;
+	}
+
+	void writeBegin()
+	{
+		mySeq.store(mySeq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	void writeEnd()
+	{
+		mySeq.store(mySeq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <assert.h>
+#include "SpinWait.h"
+
+//  Turn taking between N participants, 0..N-1
+//  Replaces the mutex + single condition_variable ping-pong of NumberInSequence2:
+//  each participant waits on its own cache line, so a handoff touches exactly
+//  the two threads involved and never wakes the wrong one
+//
+//  Usage, on participant i:
+//      seq.wait(i);
+//      ... critical turn ...
+//      seq.pass(i);            //  to (i+1) % N, or passTo(j)
+
+class sequencer
+{
+	//  Flag values
+	static constexpr uint32_t notYet = 0;   //  not our turn, waiter (if any) is spinning
+	static constexpr uint32_t go = 1;       //  our turn
+	static constexpr uint32_t parked = 2;   //  not our turn, waiter is asleep in futexWait
+
+	struct alignas(cacheLineSize) slot
+	{
+		std::atomic<uint32_t>   myFlag;
+		spinBudget              myBudget;   //  only touched by the owner
+
+		slot() : myFlag(notYet) {}
+	};
+
+	std::vector<slot> mySlots;
+
+public:
+
+	explicit sequencer(const size_t n, const size_t first = 0) : mySlots(n)
+	{
+		assert(first < n);
+		mySlots[first].myFlag.store(go, std::memory_order_relaxed);
+	}
+
+	//  Non copyable
+	sequencer(const sequencer&) = delete;
+	sequencer& operator=(const sequencer&) = delete;
+
+	size_t size() const { return mySlots.size(); }
+
+	//  Block until it is participant i's turn
+	void wait(const size_t i)
+	{
+		slot& s = mySlots[i];
+
+		//  Spin first, a handoff between running threads takes ~100ns
+		const uint32_t limit = s.myBudget.limit();
+		for (uint32_t n = 0; n < limit; ++n)
+		{
+			if (s.myFlag.load(std::memory_order_acquire) == go)
+			{
+				s.myFlag.store(notYet, std::memory_order_relaxed);
+				s.myBudget.succeeded(n);
+				return;
+			}
+			cpuRelax();
+		}
+
+		//  Then park, announcing it so that pass() knows to wake us
+		uint32_t expected = notYet;
+		if (s.myFlag.compare_exchange_strong(expected, parked, std::memory_order_acquire))
+		{
+			while (s.myFlag.load(std::memory_order_acquire) != go) futexWait(s.myFlag, parked);
+			s.myBudget.parked();
+		}
+		else s.myBudget.succeeded(limit);
+
+		s.myFlag.store(notYet, std::memory_order_relaxed);
+	}
+
+	//  End participant i's turn, hand over to the next one in the ring
+	void pass(const size_t i) { passTo((i + 1) % mySlots.size()); }
+
+	//  Hand the turn to participant j
+	//  The futex syscall is only paid when j actually went to sleep
+	void passTo(const size_t j)
+	{
+		if (mySlots[j].myFlag.exchange(go, std::memory_order_release) == parked) futexWakeOne(mySlots[j].myFlag);
+	}
+};
@@ -0,0 +1,409 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include <cmath>
+#include <thread>
+#include "matrix.h"
+
+//  Sparse companions to matrix<T>
+//  Storage and work are O(nnz) instead of O(rows*cols)
+
+//  Compressed sparse row
+//  Nonzeros of row i are myValues[myRowPtr[i]..myRowPtr[i+1]), their columns in myColIdx
+template <class T>
+class csrMatrix
+{
+public:
+	size_t              myRows;
+	size_t              myCols;
+	std::vector<size_t> myRowPtr;
+	std::vector<size_t> myColIdx;
+	std::vector<T>      myValues;
+
+	//  Constructors
+	csrMatrix() : myRows(0), myCols(0), myRowPtr(1, 0) {}
+	csrMatrix(const size_t rows, const size_t cols) : myRows(rows), myCols(cols), myRowPtr(rows + 1, 0) {}
+
+	//  Access
+	size_t rows() const { return myRows; }
+	size_t cols() const { return myCols; }
+	size_t nnz() const { return myValues.size(); }
+};
+
+//  Compressed sparse column
+//  Nonzeros of col j are myValues[myColPtr[j]..myColPtr[j+1]), their rows in myRowIdx
+template <class T>
+class cscMatrix
+{
+public:
+	size_t              myRows;
+	size_t              myCols;
+	std::vector<size_t> myColPtr;
+	std::vector<size_t> myRowIdx;
+	std::vector<T>      myValues;
+
+	//  Constructors
+	cscMatrix() : myRows(0), myCols(0), myColPtr(1, 0) {}
+	cscMatrix(const size_t rows, const size_t cols) : myRows(rows), myCols(cols), myColPtr(cols + 1, 0) {}
+
+	//  Access
+	size_t rows() const { return myRows; }
+	size_t cols() const { return myCols; }
+	size_t nnz() const { return myValues.size(); }
+};
+
+//  Conversions
+
+//  Entries with |x| <= tol are dropped
+template <class T>
+csrMatrix<T> toCSR(const matrix<T>& mat, const T tol = T(0))
+{
+	csrMatrix<T> res(mat.rows(), mat.cols());
+	for (size_t i = 0; i < mat.rows(); ++i)
+	{
+		const T* ai = mat[i];
+		for (size_t j = 0; j < mat.cols(); ++j)
+		{
+			if (std::abs(ai[j]) > tol)
+			{
+				res.myColIdx.push_back(j);
+				res.myValues.push_back(ai[j]);
+			}
+		}
+		res.myRowPtr[i + 1] = res.myValues.size();
+	}
+
+	return res;
+}
+
+template <class T>
+cscMatrix<T> toCSC(const matrix<T>& mat, const T tol = T(0))
+{
+	cscMatrix<T> res(mat.rows(), mat.cols());
+	for (size_t j = 0; j < mat.cols(); ++j)
+	{
+		//  Column walk is strided, but conversion is done once
+		for (size_t i = 0; i < mat.rows(); ++i)
+		{
+			if (std::abs(mat[i][j]) > tol)
+			{
+				res.myRowIdx.push_back(i);
+				res.myValues.push_back(mat[i][j]);
+			}
+		}
+		res.myColPtr[j + 1] = res.myValues.size();
+	}
+
+	return res;
+}
+
+//  CSR <-> CSC is a sparse transpose: count, prefix sum, scatter
+//  Indices come out sorted within each row/col
+template <class T>
+cscMatrix<T> toCSC(const csrMatrix<T>& mat)
+{
+	cscMatrix<T> res(mat.rows(), mat.cols());
+	res.myRowIdx.resize(mat.nnz());
+	res.myValues.resize(mat.nnz());
+
+	for (size_t n = 0; n < mat.nnz(); ++n) ++res.myColPtr[mat.myColIdx[n] + 1];
+	for (size_t j = 0; j < mat.cols(); ++j) res.myColPtr[j + 1] += res.myColPtr[j];
+
+	std::vector<size_t> next(res.myColPtr.begin(), res.myColPtr.end() - 1);
+	for (size_t i = 0; i < mat.rows(); ++i)
+	{
+		for (size_t n = mat.myRowPtr[i]; n < mat.myRowPtr[i + 1]; ++n)
+		{
+			const size_t dst = next[mat.myColIdx[n]]++;
+			res.myRowIdx[dst] = i;
+			res.myValues[dst] = mat.myValues[n];
+		}
+	}
+
+	return res;
+}
+
+template <class T>
+csrMatrix<T> toCSR(const cscMatrix<T>& mat)
+{
+	csrMatrix<T> res(mat.rows(), mat.cols());
+	res.myColIdx.resize(mat.nnz());
+	res.myValues.resize(mat.nnz());
+
+	for (size_t n = 0; n < mat.nnz(); ++n) ++res.myRowPtr[mat.myRowIdx[n] + 1];
+	for (size_t i = 0; i < mat.rows(); ++i) res.myRowPtr[i + 1] += res.myRowPtr[i];
+
+	std::vector<size_t> next(res.myRowPtr.begin(), res.myRowPtr.end() - 1);
+	for (size_t j = 0; j < mat.cols(); ++j)
+	{
+		for (size_t n = mat.myColPtr[j]; n < mat.myColPtr[j + 1]; ++n)
+		{
+			const size_t dst = next[mat.myRowIdx[n]]++;
+			res.myColIdx[dst] = j;
+			res.myValues[dst] = mat.myValues[n];
+		}
+	}
+
+	return res;
+}
+
+template <class T>
+matrix<T> toDense(const csrMatrix<T>& mat)
+{
+	matrix<T> res(mat.rows(), mat.cols());
+	for (size_t i = 0; i < mat.rows(); ++i)
+		for (size_t n = mat.myRowPtr[i]; n < mat.myRowPtr[i + 1]; ++n)
+			res[i][mat.myColIdx[n]] = mat.myValues[n];
+
+	return res;
+}
+
+template <class T>
+matrix<T> toDense(const cscMatrix<T>& mat)
+{
+	matrix<T> res(mat.rows(), mat.cols());
+	for (size_t j = 0; j < mat.cols(); ++j)
+		for (size_t n = mat.myColPtr[j]; n < mat.myColPtr[j + 1]; ++n)
+			res[mat.myRowIdx[n]][j] = mat.myValues[n];
+
+	return res;
+}
+
+//  Split the rows (or cols) behind a CSR/CSC pointer array into parts of ~equal nnz
+//  Returns parts+1 boundaries, part p covers [bounds[p], bounds[p+1])
+//  Splitting by row count instead would leave threads idle on skewed matrices
+inline std::vector<size_t> nnzPartition(const std::vector<size_t>& ptr, const size_t parts)
+{
+	assert(parts > 0);
+	const size_t n = ptr.size() - 1;
+	const size_t nnz = ptr.back();
+	std::vector<size_t> bounds(parts + 1, n);
+	bounds[0] = 0;
+	for (size_t p = 1; p < parts; ++p)
+	{
+		const size_t target = nnz * p / parts;
+		//  First row whose start reaches the target
+		const size_t row = std::lower_bound(ptr.begin(), ptr.end(), target) - ptr.begin();
+		bounds[p] = std::max(bounds[p - 1], std::min(row, n));
+	}
+
+	return bounds;
+}
+
+//  SpMV, y = A x
+
+template <class T>
+std::vector<T> spmv(const csrMatrix<T>& mat, const std::vector<T>& x)
+{
+	assert(mat.cols() == x.size());
+	std::vector<T> y(mat.rows());
+	for (size_t i = 0; i < mat.rows(); ++i)
+	{
+		T yi = 0;
+		for (size_t n = mat.myRowPtr[i]; n < mat.myRowPtr[i + 1]; ++n)
+			yi += mat.myValues[n] * x[mat.myColIdx[n]];
+		y[i] = yi;
+	}
+
+	return y;
+}
+
+template <class T>
+std::vector<T> spmv(const cscMatrix<T>& mat, const std::vector<T>& x)
+{
+	assert(mat.cols() == x.size());
+	std::vector<T> y(mat.rows());
+	for (size_t j = 0; j < mat.cols(); ++j)
+	{
+		const T xj = x[j];
+		for (size_t n = mat.myColPtr[j]; n < mat.myColPtr[j + 1]; ++n)
+			y[mat.myRowIdx[n]] += mat.myValues[n] * xj;
+	}
+
+	return y;
+}
+
+//  Each thread owns a contiguous block of rows with ~nnz/num_threads nonzeros
+//  Rows are disjoint so no locking on y
+template <class T>
+std::vector<T> spmvMT(const csrMatrix<T>& mat, const std::vector<T>& x, const size_t num_threads = 4)
+{
+	assert(mat.cols() == x.size() && num_threads > 0);
+	std::vector<T> y(mat.rows());
+	const std::vector<size_t> bounds = nnzPartition(mat.myRowPtr, num_threads);
+
+	auto f_ = [&mat, &x, &y, &bounds](const size_t p)
+	{
+		for (size_t i = bounds[p]; i < bounds[p + 1]; ++i)
+		{
+			T yi = 0;
+			for (size_t n = mat.myRowPtr[i]; n < mat.myRowPtr[i + 1]; ++n)
+				yi += mat.myValues[n] * x[mat.myColIdx[n]];
+			y[i] = yi;
+		}
+	};
+
+	std::vector<std::thread> myThreads(num_threads);
+	for (size_t p = 0; p < num_threads; ++p)
+		myThreads[p] = std::thread(f_, p);
+
+	for (size_t p = 0; p < num_threads; ++p)
+		myThreads[p].join();
+
+	return y;
+}
+
+//  Columns scatter into all of y, so each thread accumulates a private y
+//  over its nnz-balanced block of columns, and the partials are summed
+template <class T>
+std::vector<T> spmvMT(const cscMatrix<T>& mat, const std::vector<T>& x, const size_t num_threads = 4)
+{
+	assert(mat.cols() == x.size() && num_threads > 0);
+	const std::vector<size_t> bounds = nnzPartition(mat.myColPtr, num_threads);
+	std::vector<std::vector<T>> partials(num_threads);
+
+	auto f_ = [&mat, &x, &bounds, &partials](const size_t p)
+	{
+		std::vector<T> y(mat.rows());
+		for (size_t j = bounds[p]; j < bounds[p + 1]; ++j)
+		{
+			const T xj = x[j];
+			for (size_t n = mat.myColPtr[j]; n < mat.myColPtr[j + 1]; ++n)
+				y[mat.myRowIdx[n]] += mat.myValues[n] * xj;
+		}
+		partials[p] = std::move(y);
+	};
+
+	std::vector<std::thread> myThreads(num_threads);
+	for (size_t p = 0; p < num_threads; ++p)
+		myThreads[p] = std::thread(f_, p);
+
+	for (size_t p = 0; p < num_threads; ++p)
+		myThreads[p].join();
+
+	std::vector<T> y = std::move(partials[0]);
+	for (size_t p = 1; p < num_threads; ++p)
+		for (size_t i = 0; i < y.size(); ++i)
+			y[i] += partials[p][i];
+
+	return y;
+}
+
+//  SpMM, sparse times dense
+
+//  Same i-k-j order as matrixProduct2: each nonzero a_ik scales row k of mat2
+//  into row i of the result, both contiguous
+template <class T>
+matrix<T> spmm(const csrMatrix<T>& mat1, const matrix<T>& mat2)
+{
+	assert(mat1.cols() == mat2.rows());
+	matrix<T> res(mat1.rows(), mat2.cols());
+	for (size_t i = 0; i < mat1.rows(); ++i)
+	{
+		T* ri = res[i];
+		for (size_t n = mat1.myRowPtr[i]; n < mat1.myRowPtr[i + 1]; ++n)
+		{
+			const T aik = mat1.myValues[n];
+			const T* bk = mat2[mat1.myColIdx[n]];
+			for (size_t j = 0; j < mat2.cols(); ++j)
+				ri[j] += aik * bk[j];
+		}
+	}
+
+	return res;
+}
+
+template <class T>
+matrix<T> spmm(const cscMatrix<T>& mat1, const matrix<T>& mat2)
+{
+	assert(mat1.cols() == mat2.rows());
+	matrix<T> res(mat1.rows(), mat2.cols());
+	for (size_t k = 0; k < mat1.cols(); ++k)
+	{
+		const T* bk = mat2[k];
+		for (size_t n = mat1.myColPtr[k]; n < mat1.myColPtr[k + 1]; ++n)
+		{
+			const T aik = mat1.myValues[n];
+			T* ri = res[mat1.myRowIdx[n]];
+			for (size_t j = 0; j < mat2.cols(); ++j)
+				ri[j] += aik * bk[j];
+		}
+	}
+
+	return res;
+}
+
+//  Rows of the result split by nnz, as in spmvMT
+template <class T>
+matrix<T> spmmMT(const csrMatrix<T>& mat1, const matrix<T>& mat2, const size_t num_threads = 4)
+{
+	assert(mat1.cols() == mat2.rows() && num_threads > 0);
+	matrix<T> res(mat1.rows(), mat2.cols());
+	const std::vector<size_t> bounds = nnzPartition(mat1.myRowPtr, num_threads);
+
+	auto f_ = [&mat1, &mat2, &res, &bounds](const size_t p)
+	{
+		for (size_t i = bounds[p]; i < bounds[p + 1]; ++i)
+		{
+			T* ri = res[i];
+			for (size_t n = mat1.myRowPtr[i]; n < mat1.myRowPtr[i + 1]; ++n)
+			{
+				const T aik = mat1.myValues[n];
+				const T* bk = mat2[mat1.myColIdx[n]];
+				for (size_t j = 0; j < mat2.cols(); ++j)
+					ri[j] += aik * bk[j];
+			}
+		}
+	};
+
+	std::vector<std::thread> myThreads(num_threads);
+	for (size_t p = 0; p < num_threads; ++p)
+		myThreads[p] = std::thread(f_, p);
+
+	for (size_t p = 0; p < num_threads; ++p)
+		myThreads[p].join();
+
+	return res;
+}
+
+//  CSC scatters across rows, so the threads split the columns of mat2 instead:
+//  each walks all of mat1 and writes its own band of columns of the result,
+//  disjoint, no locking and no private copies, memory stays the output's
+//  Every nonzero costs the same in every band, so equal bands balance
+template <class T>
+matrix<T> spmmMT(const cscMatrix<T>& mat1, const matrix<T>& mat2, const size_t num_threads = 4)
+{
+	assert(mat1.cols() == mat2.rows() && num_threads > 0);
+	matrix<T> res(mat1.rows(), mat2.cols());
+	//  No more threads than columns
+	const size_t nt = std::max(size_t(1), std::min(num_threads, mat2.cols()));
+	const size_t step = (mat2.cols() + nt - 1) / nt;
+
+	auto f_ = [&mat1, &mat2, &res, step](const size_t p)
+	{
+		const size_t j_start = std::min(p * step, mat2.cols());
+		const size_t j_end = std::min(j_start + step, mat2.cols());
+		for (size_t k = 0; k < mat1.cols(); ++k)
+		{
+			const T* bk = mat2[k];
+			for (size_t n = mat1.myColPtr[k]; n < mat1.myColPtr[k + 1]; ++n)
+			{
+				const T aik = mat1.myValues[n];
+				T* ri = res[mat1.myRowIdx[n]];
+				for (size_t j = j_start; j < j_end; ++j)
+					ri[j] += aik * bk[j];
+			}
+		}
+	};
+
+	std::vector<std::thread> myThreads(nt);
+	for (size_t p = 0; p < nt; ++p)
+		myThreads[p] = std::thread(f_, p);
+
+	for (size_t p = 0; p < nt; ++p)
+		myThreads[p].join();
+
+	return res;
+}
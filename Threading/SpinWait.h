@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define THREADING_HAS_PAUSE 1
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//  Low level waiting helpers shared by the spin-then-park primitives
+
+//  Destructive interference size, hardcoded since
+//  std::hardware_destructive_interference_size is not available everywhere
+static constexpr size_t cacheLineSize = 64;
+
+//  Spin loop hint: lets the sibling hyperthread run and avoids
+//  the memory order mis-speculation penalty when the loop exits
+inline void cpuRelax()
+{
+#ifdef THREADING_HAS_PAUSE
+	_mm_pause();
+#else
+	std::this_thread::yield();
+#endif
+}
+
+//  Park the calling thread while a == expected
+//  May return spuriously, callers re-check in a loop
+//  futex on Linux, WaitOnAddress on Windows, a yield elsewhere
+inline void futexWait(std::atomic<uint32_t>& a, const uint32_t expected)
+{
+#ifdef _WIN32
+	uint32_t cmp = expected;
+	WaitOnAddress(reinterpret_cast<volatile VOID*>(&a), &cmp, sizeof(cmp), INFINITE);
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&a), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+	if (a.load(std::memory_order_relaxed) == expected) std::this_thread::yield();
+#endif
+}
+
+inline void futexWakeOne(std::atomic<uint32_t>& a)
+{
+#ifdef _WIN32
+	WakeByAddressSingle(reinterpret_cast<PVOID>(&a));
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&a), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+	(void)a;
+#endif
+}
+
+inline void futexWakeAll(std::atomic<uint32_t>& a)
+{
+#ifdef _WIN32
+	WakeByAddressAll(reinterpret_cast<PVOID>(&a));
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&a), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#else
+	(void)a;
+#endif
+}
+
+//  Adaptive spin budget
+//  Spins that end in success pull the budget towards twice what was needed,
+//  spins that end parked halve it, since they were pure waste
+//  Relaxed load/store: concurrent waiters sharing a budget may lose an update,
+//  which only drops a sample
+class spinBudget
+{
+	std::atomic<uint32_t> myLimit;
+
+public:
+
+	static constexpr uint32_t minSpins = 16;
+	static constexpr uint32_t maxSpins = 16384;
+
+	spinBudget() : myLimit(1024) {}
+
+	uint32_t limit() const { return myLimit.load(std::memory_order_relaxed); }
+
+	void succeeded(const uint32_t used)
+	{
+		const uint32_t limit = myLimit.load(std::memory_order_relaxed);
+		const uint32_t target = used * 2 < maxSpins ? used * 2 : maxSpins;
+		uint32_t next = target > limit ? target : limit - (limit - target) / 8;
+		if (next < minSpins) next = minSpins;
+		myLimit.store(next, std::memory_order_relaxed);
+	}
+
+	void parked()
+	{
+		const uint32_t limit = myLimit.load(std::memory_order_relaxed);
+		myLimit.store(limit / 2 < minSpins ? minSpins : limit / 2, std::memory_order_relaxed);
+	}
+};
@@ -0,0 +1,947 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ParallelQueue.h"
+#include "SchedulingQueue.h"
+#include "Pipeline.h"
+#include "Ledger.h"
+#include "SeqLock.h"
+#include "AdaptiveMutex.h"
+#include "Sequencer.h"
+
+//  Concurrency stress tests for the threading primitives
+//
+//  Each test runs its threads for the configured duration with randomized schedules:
+//  every thread owns a scheduleFuzzer, seeded from the config seed and its index, that
+//  injects yields and short spins between operations to shake out rare interleavings.
+//  Failures report the seed, rerun with it to get the same perturbations.
+//
+//  Most tests check invariants over long runs: nothing lost or duplicated, totals conserved,
+//  no torn reads. The linearizability tests instead record short histories, each operation
+//  with its call and return instants, and search for a sequential order of the operations
+//  that respects real time and that a sequential model of the object replays with the same
+//  results. Histories are kept small, a few operations per thread, as the search is exponential.
+//
+//  Build with -fsanitize=thread (gcc/clang) to have TSan check the same runs
+//  for data races, e.g.
+//      g++ -std=c++17 -O1 -g -fsanitize=thread -pthread main.cpp
+
+struct stressConfig
+{
+	std::chrono::milliseconds   duration = std::chrono::milliseconds(1000);
+	size_t                      threads = 4;
+	unsigned                    seed = 12345;
+};
+
+struct stressResult
+{
+	std::string name;
+	bool        passed;
+	uint64_t    ops;
+	std::string failure;
+};
+
+class scheduleFuzzer
+{
+	std::minstd_rand myRng;
+
+public:
+
+	explicit scheduleFuzzer(const unsigned seed) : myRng(seed) {}
+
+	unsigned next(const unsigned n) { return static_cast<unsigned>(myRng() % n); }
+
+	//  Perturb the interleaving here
+	void point()
+	{
+		const unsigned r = next(64);
+		if (r == 0) std::this_thread::yield();
+		else if (r < 8) for (unsigned i = 0; i < r * 8; ++i) cpuRelax();
+	}
+};
+
+//  Runs body(threadIndex, fuzzer, stop) on n threads until duration has elapsed
+template <class Body>
+void runFor(const stressConfig& cfg, const size_t n, Body body)
+{
+	std::atomic<bool> stop(false);
+	std::vector<std::thread> myThreads(n);
+	for (size_t t = 0; t < n; ++t)
+	{
+		myThreads[t] = std::thread([&body, &stop, &cfg, t]()
+		{
+			scheduleFuzzer fuzz(cfg.seed + static_cast<unsigned>(t) * 7919);
+			body(t, fuzz, stop);
+		});
+	}
+	std::this_thread::sleep_for(cfg.duration);
+	stop = true;
+	for (std::thread& t : myThreads) t.join();
+}
+
+//  Operation of a recorded history, Op holds the arguments and the observed result
+//  call and ret are ticks of one counter shared by the threads of a round:
+//  a.ret < b.call means a returned before b was called
+template <class Op>
+struct historyEvent
+{
+	Op          op;
+	uint64_t    call;
+	uint64_t    ret;
+};
+
+//  One round: n threads released together run body(t, fuzz, clock, events) on the same object,
+//  stamping each of their operations with clock++ at call and at return
+//  Returns the merged history
+template <class Op, class Body>
+std::vector<historyEvent<Op>> recordHistory(const size_t n, const unsigned seed, Body body)
+{
+	std::atomic<uint64_t> clock(0);
+	std::atomic<size_t> ready(0);
+	std::vector<std::vector<historyEvent<Op>>> events(n);
+	std::vector<std::thread> myThreads(n);
+	for (size_t t = 0; t < n; ++t)
+	{
+		myThreads[t] = std::thread([&body, &clock, &ready, &events, n, seed, t]()
+		{
+			scheduleFuzzer fuzz(seed + static_cast<unsigned>(t) * 7919);
+			++ready;
+			while (ready.load() < n) std::this_thread::yield();
+			body(t, fuzz, clock, events[t]);
+		});
+	}
+	for (std::thread& t : myThreads) t.join();
+
+	std::vector<historyEvent<Op>> history;
+	for (const std::vector<historyEvent<Op>>& e : events) history.insert(history.end(), e.begin(), e.end());
+	return history;
+}
+
+//  True if the history is linearizable with respect to Model, starting from init
+//  Model is copyable, with bool apply(const Op&), false if the sequential object would not
+//  have produced the observed result, and key(), its state, for memoization
+//  Wing and Gong search: linearize next any pending operation called before the earliest
+//  return among the pending ones, backtrack on mismatch, skip (done set, state) pairs seen before
+template <class Model, class Op>
+bool linearizable(const std::vector<historyEvent<Op>>& history, const Model& init)
+{
+	const size_t n = history.size();
+	assert(n < 64);
+	const uint64_t all = (uint64_t(1) << n) - 1;
+	std::set<std::pair<uint64_t, decltype(init.key())>> visited;
+
+	auto search = [&history, &visited, n, all](auto& self, const uint64_t done, const Model& m) -> bool
+	{
+		if (done == all) return true;
+		if (!visited.emplace(done, m.key()).second) return false;
+
+		uint64_t firstRet = UINT64_MAX;
+		for (size_t i = 0; i < n; ++i)
+			if (!(done >> i & 1)) firstRet = std::min(firstRet, history[i].ret);
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			if ((done >> i & 1) || history[i].call > firstRet) continue;
+			Model next = m;
+			if (next.apply(history[i].op) && self(self, done | uint64_t(1) << i, next)) return true;
+		}
+		return false;
+	};
+
+	return search(search, 0, init);
+}
+
+//  ConcurrentQueue, producers/consumers, unbounded or with a capacity
+//  No item lost or duplicated, each consumer sees every producer's items in push order,
+//  and a bounded queue never holds more than its capacity
+inline stressResult stressConcurrentQueue(const stressConfig& cfg, const size_t capacity = 0)
+{
+	stressResult res = { capacity ? "ConcurrentQueue MPMC bounded" : "ConcurrentQueue MPMC", true, 0, "" };
+	const size_t nProd = std::max(size_t(1), cfg.threads / 2), nCons = std::max(size_t(1), cfg.threads - nProd);
+	const uint64_t sentinel = UINT64_MAX;
+
+	ConcurrentQueue<uint64_t> q(capacity);
+	std::vector<uint64_t> produced(nProd);
+	//  Per consumer, per producer: items seen
+	std::vector<std::vector<std::vector<uint32_t>>> seen(nCons, std::vector<std::vector<uint32_t>>(nProd));
+	std::vector<std::string> errors(nCons);
+
+	std::vector<std::thread> consumers(nCons);
+	for (size_t c = 0; c < nCons; ++c)
+	{
+		consumers[c] = std::thread([&q, &seen, &errors, &cfg, c, nProd, sentinel, capacity]()
+		{
+			scheduleFuzzer fuzz(cfg.seed + 1000 + static_cast<unsigned>(c));
+			uint64_t item;
+			while (true)
+			{
+				//  Mix blocking and non-blocking pops, into arguments and optionals
+				const unsigned how = fuzz.next(8);
+				if (how == 0)
+				{
+					if (!q.tryPop(item)) { fuzz.point(); continue; }
+				}
+				else if (how == 1)
+				{
+					std::optional<uint64_t> o = q.tryPop();
+					if (!o) { fuzz.point(); continue; }
+					item = *o;
+				}
+				else if (how < 5)
+				{
+					std::optional<uint64_t> o = q.pop();
+					if (!o) break;
+					item = *o;
+				}
+				else if (!q.pop(item)) break;
+				if (item == sentinel) break;
+				if (capacity && q.size() > capacity && errors[c].empty()) errors[c] = "capacity exceeded";
+
+				const size_t p = static_cast<size_t>(item >> 32);
+				const uint32_t n = static_cast<uint32_t>(item);
+				if (p >= nProd) { errors[c] = "corrupt item"; continue; }
+				std::vector<uint32_t>& s = seen[c][p];
+				if (!s.empty() && n <= s.back() && errors[c].empty())
+					errors[c] = "producer " + std::to_string(p) + " item " + std::to_string(n) + " out of order";
+				s.push_back(n);
+				fuzz.point();
+			}
+		});
+	}
+
+	runFor(cfg, nProd, [&q, &produced](const size_t p, scheduleFuzzer& fuzz, std::atomic<bool>& stop)
+	{
+		uint32_t n = 0;
+		while (!stop)
+		{
+			const uint64_t item = (static_cast<uint64_t>(p) << 32) | n++;
+			if (fuzz.next(2)) q.push(item);
+			else q.emplace(item);
+			fuzz.point();
+		}
+		produced[p] = n;
+	});
+
+	//  One sentinel per consumer, after all items
+	for (size_t c = 0; c < nCons; ++c) q.push(sentinel);
+	for (std::thread& t : consumers) t.join();
+
+	for (size_t c = 0; c < nCons; ++c)
+		if (!errors[c].empty() && res.passed) { res.passed = false; res.failure = errors[c]; }
+
+	for (size_t p = 0; p < nProd && res.passed; ++p)
+	{
+		std::vector<uint8_t> count(produced[p]);
+		for (size_t c = 0; c < nCons; ++c)
+			for (const uint32_t n : seen[c][p])
+				if (n >= count.size() || ++count[n] > 1) { res.passed = false; res.failure = "item duplicated"; }
+		for (size_t n = 0; n < count.size() && res.passed; ++n)
+			if (count[n] == 0) { res.passed = false; res.failure = "producer " + std::to_string(p) + " item " + std::to_string(n) + " lost"; }
+		res.ops += produced[p];
+	}
+
+	return res;
+}
+
+//  Sequential FIFO, push(value) or tryPop() that found value or nothing
+struct queueOp
+{
+	bool        push;
+	uint64_t    value;
+	bool        found;
+};
+
+struct queueModel
+{
+	std::deque<uint64_t> items;
+
+	bool apply(const queueOp& op)
+	{
+		if (op.push)
+		{
+			items.push_back(op.value);
+			return true;
+		}
+		if (items.empty()) return !op.found;
+		if (!op.found || items.front() != op.value) return false;
+		items.pop_front();
+		return true;
+	}
+
+	std::vector<uint64_t> key() const { return std::vector<uint64_t>(items.begin(), items.end()); }
+};
+
+//  ConcurrentQueue, linearizability
+//  Rounds of a few pushes and tryPops per thread on a fresh queue, each history checked
+//  against a sequential FIFO, including tryPop failing only when the queue was empty
+inline stressResult stressQueueLinearizable(const stressConfig& cfg)
+{
+	stressResult res = { "ConcurrentQueue linearizable", true, 0, "" };
+	const size_t n = std::min(size_t(4), std::max(size_t(2), cfg.threads)), opsPerThread = 5;
+	const auto deadline = std::chrono::steady_clock::now() + cfg.duration;
+	for (unsigned round = 0; std::chrono::steady_clock::now() < deadline; ++round)
+	{
+		ConcurrentQueue<uint64_t> q;
+		//  Start non-empty now and then, so that pops race with each other and not only with pushes
+		const uint64_t preloaded = round % 3 == 0 ? 2 : 0;
+		queueModel init;
+		for (uint64_t v = 0; v < preloaded; ++v)
+		{
+			q.push(1000 + v);
+			init.items.push_back(1000 + v);
+		}
+
+		const std::vector<historyEvent<queueOp>> history = recordHistory<queueOp>(n, cfg.seed + round * 31,
+			[&q, opsPerThread](const size_t t, scheduleFuzzer& fuzz, std::atomic<uint64_t>& clock, std::vector<historyEvent<queueOp>>& events)
+		{
+			for (size_t k = 0; k < opsPerThread; ++k)
+			{
+				historyEvent<queueOp> e = { { fuzz.next(2) == 0, t * 100 + k, false }, 0, 0 };
+				fuzz.point();
+				e.call = clock++;
+				if (e.op.push) q.push(e.op.value);
+				else e.op.found = q.tryPop(e.op.value);
+				e.ret = clock++;
+				events.push_back(e);
+			}
+		});
+
+		res.ops += history.size();
+		if (!linearizable(history, init))
+		{
+			res.passed = false;
+			res.failure = "history of " + std::to_string(history.size()) + " operations not linearizable, round " + std::to_string(round);
+			break;
+		}
+	}
+	return res;
+}
+
+//  ConcurrentQueue, interrupt
+//  Every consumer blocked in pop() must return false once interrupted
+inline stressResult stressQueueInterrupt(const stressConfig& cfg)
+{
+	stressResult res = { "ConcurrentQueue interrupt", true, 0, "" };
+	const auto deadline = std::chrono::steady_clock::now() + cfg.duration;
+	while (std::chrono::steady_clock::now() < deadline)
+	{
+		ConcurrentQueue<int> q;
+		std::atomic<size_t> exited(0);
+		std::vector<std::thread> consumers(cfg.threads);
+		for (size_t c = 0; c < cfg.threads; ++c)
+		{
+			consumers[c] = std::thread([&q, &exited]()
+			{
+				int item;
+				while (q.pop(item)) {}
+				++exited;
+			});
+		}
+		for (int n = 0; n < 100; ++n) q.push(n);
+		q.interrupt();
+		for (std::thread& t : consumers) t.join();
+		if (exited != cfg.threads) { res.passed = false; res.failure = "consumer stuck after interrupt"; break; }
+		++res.ops;
+	}
+	return res;
+}
+
+//  schedulingQueue, producers at random levels and deadlines, aging every ms
+//  Consumer 0 only serves level 0, the others serve all levels, aging stops at level 1
+//  No item lost or duplicated, everything drains despite the reservation,
+//  and consumer 0 only ever gets items pushed at level 0
+inline stressResult stressSchedulingQueue(const stressConfig& cfg)
+{
+	stressResult res = { "schedulingQueue", true, 0, "" };
+	const size_t nProd = std::max(size_t(1), cfg.threads / 2), nCons = std::max(size_t(2), cfg.threads - nProd);
+	const size_t levels = 4;
+
+	schedulingQueue<uint64_t> q(levels, 2, std::chrono::milliseconds(1));
+	q.setAgingLimit(1);
+	std::vector<uint64_t> produced(nProd);
+	std::vector<std::vector<uint64_t>> seen(nCons);
+	std::atomic<bool> reservationBroken(false);
+
+	std::vector<std::thread> consumers(nCons);
+	for (size_t c = 0; c < nCons; ++c)
+	{
+		consumers[c] = std::thread([&q, &seen, &reservationBroken, &cfg, c, levels]()
+		{
+			scheduleFuzzer fuzz(cfg.seed + 2000 + static_cast<unsigned>(c));
+			const size_t maxLevel = c == 0 ? 0 : levels - 1;
+			uint64_t item;
+			while (q.pop(item, maxLevel))
+			{
+				if (c == 0 && item >> 62) reservationBroken = true;
+				seen[c].push_back(item & ~(uint64_t(3) << 62));
+				fuzz.point();
+			}
+		});
+	}
+
+	runFor(cfg, nProd, [&q, &produced](const size_t p, scheduleFuzzer& fuzz, std::atomic<bool>& stop)
+	{
+		uint32_t n = 0;
+		while (!stop)
+		{
+			const uint64_t level = fuzz.next(4);
+			const uint64_t item = (level << 62) | (static_cast<uint64_t>(p) << 32) | n++;
+			if (fuzz.next(2)) q.push(item, level);
+			else q.push(item, level, std::chrono::steady_clock::now() + std::chrono::microseconds(fuzz.next(5000)));
+			fuzz.point();
+		}
+		produced[p] = n;
+	});
+
+	//  Let the unrestricted consumers drain, then release everyone
+	while (!q.empty()) std::this_thread::yield();
+	q.interrupt();
+	for (std::thread& t : consumers) t.join();
+
+	if (reservationBroken) { res.passed = false; res.failure = "reserved consumer served an aged item"; }
+
+	std::vector<std::vector<uint8_t>> count(nProd);
+	for (size_t p = 0; p < nProd; ++p) count[p].resize(produced[p]);
+	for (size_t c = 0; c < nCons && res.passed; ++c)
+	{
+		for (const uint64_t item : seen[c])
+		{
+			const size_t p = static_cast<size_t>(item >> 32);
+			const uint32_t n = static_cast<uint32_t>(item);
+			if (p >= nProd || n >= count[p].size()) { res.passed = false; res.failure = "corrupt item"; break; }
+			if (++count[p][n] > 1) { res.passed = false; res.failure = "item duplicated"; break; }
+		}
+	}
+	for (size_t p = 0; p < nProd && res.passed; ++p)
+	{
+		for (size_t n = 0; n < count[p].size() && res.passed; ++n)
+			if (count[p][n] == 0) { res.passed = false; res.failure = "producer " + std::to_string(p) + " item " + std::to_string(n) + " lost"; }
+		res.ops += produced[p];
+	}
+
+	return res;
+}
+
+//  schedulingQueue, dispatch order
+//  Rounds of concurrent pushes at random levels and deadlines, without aging, then one
+//  consumer drains: levels must come out in order, within a level earliest deadline first,
+//  and at equal deadlines each producer's items in push order
+//  Then with aging: below the limit an aged item queues behind those pushed at its new
+//  level, at the limit it competes with them by push order, and it never rises above it
+inline stressResult stressSchedulingOrder(const stressConfig& cfg)
+{
+	typedef schedulingQueue<uint64_t>::clock clock;
+	stressResult res = { "schedulingQueue order", true, 0, "" };
+	const size_t nProd = std::max(size_t(2), cfg.threads), levels = 4, perProducer = 200;
+
+	const auto deadline = clock::now() + cfg.duration;
+	for (unsigned round = 0; clock::now() < deadline && res.passed; ++round)
+	{
+		schedulingQueue<uint64_t> q(levels, 2, std::chrono::hours(1));
+		const clock::time_point t0 = clock::now();
+		//  Per producer, per item: level and deadline
+		std::vector<std::vector<std::pair<size_t, clock::time_point>>> pushed(nProd, std::vector<std::pair<size_t, clock::time_point>>(perProducer));
+
+		std::vector<std::thread> producers(nProd);
+		for (size_t p = 0; p < nProd; ++p)
+		{
+			producers[p] = std::thread([&q, &pushed, &cfg, t0, p, round, levels, perProducer]()
+			{
+				scheduleFuzzer fuzz(cfg.seed + 3000 + round * 31 + static_cast<unsigned>(p));
+				for (size_t n = 0; n < perProducer; ++n)
+				{
+					const size_t level = fuzz.next(static_cast<unsigned>(levels));
+					//  Few distinct deadlines, so that ties are common
+					const clock::time_point d = fuzz.next(3) == 0 ? schedulingQueue<uint64_t>::noDeadline
+						: t0 + std::chrono::milliseconds(fuzz.next(8));
+					pushed[p][n] = { level, d };
+					q.push((static_cast<uint64_t>(p) << 32) | n, level, d);
+					fuzz.point();
+				}
+			});
+		}
+		for (std::thread& t : producers) t.join();
+
+		size_t lastLevel = 0;
+		clock::time_point lastDeadline = clock::time_point::min();
+		std::vector<int64_t> lastOf(nProd, -1);
+		uint64_t item;
+		while (q.tryPop(item) && res.passed)
+		{
+			const size_t p = static_cast<size_t>(item >> 32), n = static_cast<uint32_t>(item);
+			const size_t level = pushed[p][n].first;
+			const clock::time_point d = pushed[p][n].second;
+			if (level != lastLevel || d != lastDeadline) std::fill(lastOf.begin(), lastOf.end(), -1);
+			if (level < lastLevel) res.failure = "level " + std::to_string(level) + " after level " + std::to_string(lastLevel);
+			else if (level == lastLevel && d < lastDeadline) res.failure = "deadlines out of order in level " + std::to_string(level);
+			else if (static_cast<int64_t>(n) < lastOf[p]) res.failure = "producer " + std::to_string(p) + " out of push order";
+			res.passed = res.failure.empty();
+			lastLevel = level;
+			lastDeadline = d;
+			lastOf[p] = static_cast<int64_t>(n);
+			++res.ops;
+		}
+		if (res.passed && res.ops != (round + 1) * nProd * perProducer) { res.passed = false; res.failure = "items lost"; }
+	}
+
+	//  Aging, once, with an interval long enough that no second sweep comes while we pop
+	if (res.passed)
+	{
+		schedulingQueue<uint64_t> q(levels, 2, std::chrono::milliseconds(20));
+		q.setAgingLimit(1);
+		q.push(3, 3);
+		q.push(2, 2);
+		std::this_thread::sleep_for(std::chrono::milliseconds(30));
+		q.push(20, 2);
+		//  The sweep: 2 to level 1, the limit, 3 to level 2, 20 too recent to move
+		uint64_t item = 0;
+		if (q.tryPop(item, 0)) res.failure = "aged above the limit";
+		q.push(10, 1);
+		q.push(0, 0);
+		//  At the limit, 2 competes by push order with 10, below it 3 queues behind 20
+		const uint64_t expected[] = { 0, 2, 10, 20, 3 };
+		for (const uint64_t e : expected)
+		{
+			if (!res.failure.empty()) break;
+			if (!q.tryPop(item)) res.failure = "aged item lost";
+			else if (item != e) res.failure = "aged item " + std::to_string(item) + " served before " + std::to_string(e);
+		}
+		res.passed = res.failure.empty();
+	}
+
+	return res;
+}
+
+//  schedulingQueue, aging under a continuous stream at the aging limit
+//  Producers keep level 0 busy, and the consumer pushes a level 0 item before each pop,
+//  so level 0 is never empty: an item pushed at level 1 must still age to level 0 and be
+//  served, rather than wait behind every fresh level 0 item
+inline stressResult stressSchedulingAging(const stressConfig& cfg)
+{
+	typedef schedulingQueue<uint64_t>::clock clock;
+	stressResult res = { "schedulingQueue aging", true, 0, "" };
+	const size_t nProd = std::max(size_t(2), cfg.threads) - 1;
+	const uint64_t marker = ~uint64_t(0);
+
+	schedulingQueue<uint64_t> q(2, 0, std::chrono::milliseconds(1));
+	std::atomic<bool> stop(false);
+	std::vector<std::thread> producers(nProd);
+	for (size_t p = 0; p < nProd; ++p)
+	{
+		producers[p] = std::thread([&q, &stop, &cfg, p]()
+		{
+			scheduleFuzzer fuzz(cfg.seed + 4000 + static_cast<unsigned>(p));
+			uint64_t n = 0;
+			while (!stop)
+			{
+				if (q.size() < 64) q.push(n++, 0);
+				else std::this_thread::yield();
+				fuzz.point();
+			}
+		});
+	}
+
+	const auto deadline = clock::now() + cfg.duration;
+	while (clock::now() < deadline && res.passed)
+	{
+		q.push(marker, 1);
+		const clock::time_point t0 = clock::now();
+		bool served = false;
+		uint64_t item;
+		while (!served && clock::now() - t0 < std::chrono::milliseconds(200))
+		{
+			q.push(0, 0);
+			if (q.tryPop(item)) served = item == marker;
+		}
+		if (!served) { res.passed = false; res.failure = "aged item starved by a stream at the limit"; }
+		++res.ops;
+	}
+
+	stop = true;
+	for (std::thread& t : producers) t.join();
+	return res;
+}
+
+//  ledger
+//  No balance ever observed negative, and the final total matches deposits - withdrawals
+inline stressResult stressLedger(const stressConfig& cfg)
+{
+	stressResult res = { "ledger", true, 0, "" };
+	const size_t nAccounts = 16;
+	const double initial = 100;
+	ledger book(nAccounts);
+	for (size_t i = 0; i < nAccounts; ++i) book.deposit(i, initial);
+
+	std::atomic<int64_t> net(0);
+	std::atomic<uint64_t> ops(0);
+	std::atomic<bool> negative(false);
+
+	runFor(cfg, cfg.threads, [&book, &net, &ops, &negative, nAccounts](const size_t t, scheduleFuzzer& fuzz, std::atomic<bool>& stop)
+	{
+		while (!stop)
+		{
+			const size_t i = fuzz.next(static_cast<unsigned>(nAccounts)), j = fuzz.next(static_cast<unsigned>(nAccounts));
+			const int amount = static_cast<int>(fuzz.next(50));
+			//  Half the threads read, half write
+			if (t % 2 == 0)
+			{
+				switch (fuzz.next(3))
+				{
+				case 0: book.deposit(i, amount); net += amount; break;
+				case 1: if (book.withdraw(i, amount)) net -= amount; break;
+				default: book.transfer(i, j, amount); break;
+				}
+			}
+			else
+			{
+				if (book.getBalance(i) < 0) negative = true;
+				for (const double b : book.snapshot(0, nAccounts)) if (b < 0) negative = true;
+			}
+			++ops;
+			fuzz.point();
+		}
+	});
+
+	res.ops = ops;
+	const double expected = initial * nAccounts + static_cast<double>(net.load());
+	if (negative) { res.passed = false; res.failure = "negative balance observed"; }
+	else if (book.totalBalance(0, nAccounts) != expected)
+	{
+		res.passed = false;
+		res.failure = "total " + std::to_string(book.totalBalance(0, nAccounts)) + " expected " + std::to_string(expected);
+	}
+	return res;
+}
+
+//  Sequential accounts, each ledger operation with its arguments and observed result
+struct ledgerOp
+{
+	enum kind { deposit, withdraw, transfer, balance, snapshot };
+
+	kind                what;
+	size_t              i;
+	size_t              j;
+	double              amount;
+	bool                ok;
+	std::vector<double> balances;  //  getBalance: one, snapshot: all
+};
+
+struct ledgerModel
+{
+	std::vector<double> balances;
+
+	bool apply(const ledgerOp& op)
+	{
+		switch (op.what)
+		{
+		case ledgerOp::deposit:
+			balances[op.i] += op.amount;
+			return true;
+		case ledgerOp::withdraw:
+			if (balances[op.i] < op.amount) return !op.ok;
+			balances[op.i] -= op.amount;
+			return op.ok;
+		case ledgerOp::transfer:
+			if (op.i == op.j) return op.ok;
+			if (balances[op.i] < op.amount) return !op.ok;
+			balances[op.i] -= op.amount;
+			balances[op.j] += op.amount;
+			return op.ok;
+		case ledgerOp::balance:
+			return op.balances[0] == balances[op.i];
+		default:
+			return op.balances == balances;
+		}
+	}
+
+	const std::vector<double>& key() const { return balances; }
+};
+
+//  ledger, linearizability
+//  Rounds of a few random operations per thread on a fresh 2 account ledger, each history
+//  checked against sequential accounts: refusals only on insufficient balance, and reads,
+//  snapshots included, returning balances that held at one instant within the call
+inline stressResult stressLedgerLinearizable(const stressConfig& cfg)
+{
+	stressResult res = { "ledger linearizable", true, 0, "" };
+	const size_t n = std::min(size_t(4), std::max(size_t(2), cfg.threads)), opsPerThread = 5, nAccounts = 2;
+	const double initial = 20;
+	const auto deadline = std::chrono::steady_clock::now() + cfg.duration;
+	for (unsigned round = 0; std::chrono::steady_clock::now() < deadline; ++round)
+	{
+		ledger book(nAccounts);
+		ledgerModel init;
+		for (size_t a = 0; a < nAccounts; ++a)
+		{
+			book.deposit(a, initial);
+			init.balances.push_back(initial);
+		}
+
+		const std::vector<historyEvent<ledgerOp>> history = recordHistory<ledgerOp>(n, cfg.seed + round * 31,
+			[&book, opsPerThread, nAccounts](const size_t, scheduleFuzzer& fuzz, std::atomic<uint64_t>& clock, std::vector<historyEvent<ledgerOp>>& events)
+		{
+			for (size_t k = 0; k < opsPerThread; ++k)
+			{
+				historyEvent<ledgerOp> e;
+				e.op.what = static_cast<ledgerOp::kind>(fuzz.next(5));
+				e.op.i = fuzz.next(static_cast<unsigned>(nAccounts));
+				e.op.j = fuzz.next(static_cast<unsigned>(nAccounts));
+				//  Whole amounts, so the model's sums are exact
+				e.op.amount = static_cast<double>(fuzz.next(30));
+				e.op.ok = true;
+				fuzz.point();
+				e.call = clock++;
+				switch (e.op.what)
+				{
+				case ledgerOp::deposit: book.deposit(e.op.i, e.op.amount); break;
+				case ledgerOp::withdraw: e.op.ok = book.withdraw(e.op.i, e.op.amount); break;
+				case ledgerOp::transfer: e.op.ok = book.transfer(e.op.i, e.op.j, e.op.amount); break;
+				case ledgerOp::balance: e.op.balances.assign(1, book.getBalance(e.op.i)); break;
+				default: e.op.balances = book.snapshot(0, nAccounts); break;
+				}
+				e.ret = clock++;
+				events.push_back(std::move(e));
+			}
+		});
+
+		res.ops += history.size();
+		if (!linearizable(history, init))
+		{
+			res.passed = false;
+			res.failure = "history of " + std::to_string(history.size()) + " operations not linearizable, round " + std::to_string(round);
+			break;
+		}
+	}
+	return res;
+}
+
+//  seqLock
+//  A writer keeps x + y == 0, readers must never see a torn pair
+inline stressResult stressSeqLock(const stressConfig& cfg)
+{
+	stressResult res = { "seqLock", true, 0, "" };
+	seqLock lock;
+	std::atomic<int64_t> x(0), y(0);
+	std::atomic<uint64_t> ops(0);
+	std::atomic<bool> torn(false);
+
+	runFor(cfg, std::max(size_t(2), cfg.threads), [&lock, &x, &y, &ops, &torn](const size_t t, scheduleFuzzer& fuzz, std::atomic<bool>& stop)
+	{
+		int64_t v = 0;
+		while (!stop)
+		{
+			if (t == 0)
+			{
+				//  Single writer, no writer mutex needed
+				++v;
+				lock.writeBegin();
+				x.store(v, std::memory_order_relaxed);
+				fuzz.point();
+				y.store(-v, std::memory_order_relaxed);
+				lock.writeEnd();
+			}
+			else
+			{
+				uint64_t s;
+				int64_t a, b;
+				do
+				{
+					s = lock.readBegin();
+					a = x.load(std::memory_order_relaxed);
+					b = y.load(std::memory_order_relaxed);
+				} while (lock.readRetry(s));
+				if (a + b != 0) torn = true;
+			}
+			++ops;
+			fuzz.point();
+		}
+	});
+
+	res.ops = ops;
+	if (torn) { res.passed = false; res.failure = "torn read"; }
+	return res;
+}
+
+//  adaptiveMutex
+//  Mutual exclusion: never two owners, and no lost increments
+inline stressResult stressAdaptiveMutex(const stressConfig& cfg)
+{
+	stressResult res = { "adaptiveMutex", true, 0, "" };
+	adaptiveMutex mut;
+	uint64_t counter = 0;  //  plain, protected by mut
+	std::atomic<int> inside(0);
+	std::atomic<uint64_t> ops(0);
+	std::atomic<bool> overlap(false);
+
+	runFor(cfg, cfg.threads, [&mut, &counter, &inside, &ops, &overlap](const size_t, scheduleFuzzer& fuzz, std::atomic<bool>& stop)
+	{
+		while (!stop)
+		{
+			if (fuzz.next(8) == 0) { if (!mut.try_lock()) continue; }
+			else mut.lock();
+			if (++inside != 1) overlap = true;
+			++counter;
+			fuzz.point();
+			--inside;
+			mut.unlock();
+			++ops;
+		}
+	});
+
+	res.ops = ops;
+	if (overlap) { res.passed = false; res.failure = "two owners at once"; }
+	else if (counter != ops) { res.passed = false; res.failure = "lost increments"; }
+	return res;
+}
+
+//  sequencer
+//  Turns go around the ring strictly in order
+inline stressResult stressSequencer(const stressConfig& cfg)
+{
+	stressResult res = { "sequencer", true, 0, "" };
+	const size_t n = std::max(size_t(2), cfg.threads);
+	sequencer seq(n);
+	size_t last = n - 1;   //  plain, only touched by the turn holder
+	uint64_t turns = 0;
+	bool outOfOrder = false;
+	std::atomic<bool> done(false);
+
+	runFor(cfg, n, [&seq, &last, &turns, &outOfOrder, &done, n](const size_t me, scheduleFuzzer& fuzz, std::atomic<bool>& stop)
+	{
+		while (true)
+		{
+			seq.wait(me);
+			//  The first participant to see stop ends the ring for everyone
+			if (stop) done = true;
+			if (done)
+			{
+				seq.pass(me);
+				return;
+			}
+			if (last != (me + n - 1) % n) outOfOrder = true;
+			last = me;
+			++turns;
+			fuzz.point();
+			seq.pass(me);
+		}
+	});
+
+	res.ops = turns;
+	if (outOfOrder) { res.passed = false; res.failure = "turn out of order"; }
+	return res;
+}
+
+//  pipeline, three stages of random width and batch, the middle one unordered
+//  Ordered runs must come out complete and in order, and interrupted ones must
+//  stop every thread, including a producer blocked by backpressure
+//  In failing runs the middle stage throws on one item: pop and wait must rethrow it,
+//  and the producer must see push fail and stop
+//  A few slow items in the first stage make its siblings run ahead, yet no ordered
+//  stage may hold more packets for their turn than its capacity
+inline stressResult stressPipeline(const stressConfig& cfg)
+{
+	stressResult res = { "pipeline", true, 0, "" };
+	scheduleFuzzer fuzz(cfg.seed + 3000);
+	const auto deadline = std::chrono::steady_clock::now() + cfg.duration;
+	while (std::chrono::steady_clock::now() < deadline && res.passed)
+	{
+		const bool ordered = fuzz.next(2) == 0, interrupted = fuzz.next(4) == 0, failing = !interrupted && fuzz.next(4) == 0;
+		const uint64_t n = 1 + fuzz.next(5000), failAt = n / 2;
+		pipeline<uint64_t> source(1 + fuzz.next(64), 1 + fuzz.next(4));
+		const stageOptions opts[] = {
+			stageOptions(1 + fuzz.next(4), true, 1 + fuzz.next(32), 1 + fuzz.next(4)),
+			stageOptions(1 + fuzz.next(4), ordered, 1 + fuzz.next(32), 1 + fuzz.next(4)),
+			stageOptions(1 + fuzz.next(4), true, 1 + fuzz.next(32), 1 + fuzz.next(4)) };
+		auto p = std::move(source)
+			.then("a", [](uint64_t x)
+			{
+				if (x % 1009 == 500) std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				return x;
+			}, opts[0])
+			.then("b", [failing, failAt](uint64_t x)
+			{
+				if (failing && x == failAt) throw std::runtime_error("bad item");
+				return x * 3;
+			}, opts[1])
+			.then("c", [](uint64_t x) { return x + 1; }, opts[2]);
+		p.start();
+
+		std::thread producer([&p, n]()
+		{
+			for (uint64_t i = 0; i < n; ++i) if (!p.push(i)) return;
+			p.close();
+		});
+
+		uint64_t count = 0, sum = 0;
+		bool inOrder = true, popThrew = false, waitThrew = false;
+		uint64_t v;
+		try
+		{
+			while (p.pop(v))
+			{
+				inOrder = inOrder && v == count * 3 + 1;
+				sum += v;
+				if (interrupted && count == n / 2) p.interrupt();
+				++count;
+			}
+		}
+		catch (const std::runtime_error&) { popThrew = true; }
+		producer.join();
+		try { p.wait(); }
+		catch (const std::runtime_error&) { waitThrew = true; }
+
+		if (failing)
+		{
+			if (!popThrew || !waitThrew) { res.passed = false; res.failure = "stage exception not rethrown"; }
+		}
+		else if (popThrew || waitThrew) { res.passed = false; res.failure = "exception without a failing stage"; }
+		else if (!interrupted)
+		{
+			if (count != n || sum != 3 * (n * (n - 1) / 2) + n) { res.passed = false; res.failure = "items lost or duplicated"; }
+			else if (ordered && !inOrder) { res.passed = false; res.failure = "ordered pipeline out of order"; }
+		}
+		const std::vector<stageStats> st = p.stats();
+		for (size_t i = 0; i < st.size() && res.passed; ++i)
+			if (st[i].reorderPeak > opts[i].capacity) { res.passed = false; res.failure = "stage " + st[i].name + " reorder buffer over capacity"; }
+		res.ops += count;
+	}
+	return res;
+}
+
+//  Runs every test, prints one line each, true if all passed
+inline bool runStressTests(const stressConfig& cfg = stressConfig())
+{
+	std::vector<stressResult> results;
+	results.push_back(stressConcurrentQueue(cfg));
+	results.push_back(stressConcurrentQueue(cfg, 8));
+	results.push_back(stressQueueLinearizable(cfg));
+	results.push_back(stressQueueInterrupt(cfg));
+	results.push_back(stressSchedulingQueue(cfg));
+	results.push_back(stressSchedulingOrder(cfg));
+	results.push_back(stressSchedulingAging(cfg));
+	results.push_back(stressLedger(cfg));
+	results.push_back(stressLedgerLinearizable(cfg));
+	results.push_back(stressSeqLock(cfg));
+	results.push_back(stressAdaptiveMutex(cfg));
+	results.push_back(stressSequencer(cfg));
+	results.push_back(stressPipeline(cfg));
+
+	bool ok = true;
+	for (const stressResult& r : results)
+	{
+		if (r.passed) std::cout << "PASS " << r.name << " (" << r.ops << " ops)\n";
+		else std::cout << "FAIL " << r.name << ": " << r.failure << " (seed " << cfg.seed << ")\n";
+		ok = ok && r.passed;
+	}
+	return ok;
+}
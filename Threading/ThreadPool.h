@@ -0,0 +1,175 @@
+#pragma once
+
+#include <atomic>
+#include <future>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include "SchedulingQueue.h"
+
+//  Shared thread pool, one instance per process
+//  Workers pop tasks from a schedulingQueue until the pool is stopped
+//  Tasks run by priority, then earliest deadline, see SchedulingQueue.h
+
+typedef std::packaged_task<bool(void)> Task;
+typedef std::future<bool> TaskHandle;
+
+//  Most urgent first, spawnTask(c) is priorityNormal
+enum taskPriority
+{
+	priorityCritical,
+	priorityHigh,
+	priorityNormal,
+	priorityBatch,
+	numPriorities
+};
+
+class ThreadPool
+{
+	schedulingQueue<Task>       myQueue;
+	std::vector<std::thread>    myThreads;
+	bool                        myActive;
+
+	//  Number of workers that only serve up to each priority
+	size_t                      myReserved[numPriorities];
+
+	//  Threads sleeping in helpUntil, woken by spawnTask and notifyHelpers
+	std::mutex                  myHelpMutex;
+	std::condition_variable     myHelpCV;
+	std::atomic<size_t>         myHelpers;
+
+	//  1..n on workers, 0 on the main thread and any thread not owned by the pool
+	static inline thread_local size_t myTLSNum = 0;
+
+	//  Worker loop, returns when the queue is interrupted and nothing it serves is left
+	void threadFunc(const size_t num, const size_t maxPriority)
+	{
+		myTLSNum = num;
+		Task t;
+		while (myQueue.pop(t, maxPriority)) t();
+		while (myQueue.tryPop(t, maxPriority)) t();
+	}
+
+	//  Singleton
+	ThreadPool() : myQueue(numPriorities, priorityNormal), myActive(false), myReserved{}, myHelpers(0) {}
+
+public:
+
+	static ThreadPool* getInstance()
+	{
+		static ThreadPool instance;
+		return &instance;
+	}
+
+	//  Non copyable, non movable
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool() { stop(); }
+
+	size_t numThreads() const { return myThreads.size(); }
+	static size_t threadNum() { return myTLSNum; }
+
+	//  Keep n workers for tasks of priority p or more urgent, applies from the next start()
+	//  e.g. reserveWorkers(priorityCritical, 1) so that critical tasks never queue behind batch work
+	//  Less urgent tasks then age no further than the priority below the least urgent reservation
+	void reserveWorkers(const taskPriority p, const size_t n) { myReserved[p] = n; }
+
+	//  Default leaves one core to the main thread, which helps through activeWait
+	//  Reservations take the first workers, capped at nThread
+	void start(const size_t nThread = std::max(1u, std::thread::hardware_concurrency()) - 1)
+	{
+		if (myActive) return;
+		myThreads.reserve(nThread);
+		std::vector<size_t> maxPriority;
+		for (size_t p = 0; p < numPriorities; ++p)
+			maxPriority.insert(maxPriority.end(), myReserved[p], p);
+		if (maxPriority.size() > nThread) maxPriority.resize(nThread);
+		myQueue.setAgingLimit(maxPriority.empty() ? 0 : maxPriority.back() + 1);
+		for (size_t i = 0; i < nThread; ++i)
+			myThreads.push_back(std::thread(&ThreadPool::threadFunc, this, i + 1, i < maxPriority.size() ? maxPriority[i] : size_t(numPriorities - 1)));
+		myActive = true;
+	}
+
+	//  Drains: every queued task runs before stop() returns, on the workers,
+	//  then on the calling thread for what they left, e.g. levels only reserved workers skip
+	//  Dropping them instead would leave their futures, and any continuation, waiting forever
+	void stop()
+	{
+		if (!myActive) return;
+		myQueue.interrupt();
+		for (std::thread& t : myThreads) t.join();
+		myThreads.clear();
+		myQueue.resetInterrupt();
+		while (runPendingTask());
+		myActive = false;
+	}
+
+	//  Callable must return bool
+	template <typename Callable>
+	TaskHandle spawnTask(Callable c)
+	{
+		return spawnTask(std::move(c), priorityNormal);
+	}
+
+	//  Within a priority, tasks with a deadline run earliest first, before those without
+	template <typename Callable>
+	TaskHandle spawnTask(Callable c, const taskPriority p,
+		const std::chrono::steady_clock::time_point deadline = schedulingQueue<Task>::noDeadline)
+	{
+		Task t(std::move(c));
+		TaskHandle f = t.get_future();
+		myQueue.push(std::move(t), p, deadline);
+		notifyHelpers();
+		return f;
+	}
+
+	//  Run one queued task on the calling thread, false if there was none
+	bool runPendingTask()
+	{
+		Task t;
+		if (!myQueue.tryPop(t)) return false;
+		t();
+		return true;
+	}
+
+	//  Wait until ready(), running queued tasks meanwhile
+	//  Sleeps while none is queued, until the next spawnTask or notifyHelpers(),
+	//  so whatever makes ready() true must call notifyHelpers() after
+	template <class Ready>
+	void helpUntil(Ready ready)
+	{
+		while (!ready())
+		{
+			if (runPendingTask()) continue;
+			std::unique_lock<std::mutex> lk(myHelpMutex);
+			//  Pairs with the push, or the change to ready(), then the load in notifyHelpers()
+			++myHelpers;
+			myHelpCV.wait(lk, [this, &ready] { return !myQueue.empty() || ready(); });
+			--myHelpers;
+		}
+	}
+
+	void notifyHelpers()
+	{
+		if (!myHelpers.load()) return;
+		std::lock_guard<std::mutex> lk(myHelpMutex);
+		myHelpCV.notify_all();
+	}
+
+	//  Wait for a task, running queued tasks meanwhile instead of sleeping
+	//  Returns true if the caller executed any
+	bool activeWait(const TaskHandle& f)
+	{
+		bool b = false;
+		while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		{
+			if (runPendingTask()) b = true;
+			else f.wait();
+		}
+		return b;
+	}
+};
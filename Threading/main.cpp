@@ -5,8 +5,18 @@
 #include <mutex>
 #include <condition_variable>
 #include "matrix.h"
+#include "SparseMatrix.h"
 #include <chrono>
 #include <numeric>
+#include "MatrixFile.h"
+#include "AsyncMatrix.h"
+#include "Sequencer.h"
+#include "SeqLock.h"
+#include "Ledger.h"
+#include "MatrixOps.h"
+#include "BatchedProduct.h"
+#include "StressTest.h"
+#include "Pipeline.h"
 #include "TemplateTest.h"
 
 class BankAccount
@@ -49,7 +59,7 @@ class BankAccountLocked
 {
 private:
 	double balance;
-	std::mutex myMutex;
+	mutable std::mutex myMutex;
 public:
 	BankAccountLocked() : balance(0) {};
 
@@ -84,7 +94,11 @@ public:
 
 	double getBalance() const
 	{
-		return balance;
+		//reading while another thread deposits is a race too
+		myMutex.lock();
+		double b = balance;
+		myMutex.unlock();
+		return b;
 	}
 };
 
@@ -93,7 +107,7 @@ class BankAccountAutoLocked
 {
 private:
 	double balance;
-	std::mutex myMutex;
+	mutable std::mutex myMutex;
 public:
 	BankAccountAutoLocked() : balance(0) {};
 
@@ -130,10 +144,62 @@ public:
 
 	double getBalance() const
 	{
+		//readers are serialized with each other and wait out a whole withdraw
+		std::lock_guard<std::mutex> lg(myMutex);
 		return balance;
 	}
 };
 
+class BankAccountSeqLocked
+{
+private:
+	std::atomic<double> balance;
+	std::mutex myMutex; //writers only
+	seqLock mySeq;
+public:
+	BankAccountSeqLocked() : balance(0) {};
+
+	void deposit(const double amount)
+	{
+		std::lock_guard<std::mutex> lg(myMutex);
+		mySeq.writeBegin();
+		balance.store(balance.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+		mySeq.writeEnd();
+	}
+
+	void withdraw(const double amount)
+	{
+		std::lock_guard<std::mutex> lg(myMutex);
+		std::cout << "Entering: " << std::this_thread::get_id() << "\n";
+		double b = balance.load(std::memory_order_relaxed);
+		if (b > amount)
+		{
+			std::chrono::milliseconds span(2000);
+			std::this_thread::sleep_for(span);
+			//only the store itself is a write section, readers don't wait for the sleep
+			mySeq.writeBegin();
+			balance.store(b - amount, std::memory_order_relaxed);
+			mySeq.writeEnd();
+			std::cout << "Withdraw " << std::this_thread::get_id() << "\n";
+			std::cout << "Amount " << amount << " withdrawn" << "\n";
+			std::cout << "New Balance " << b - amount << "\n";
+		}
+	}
+
+	double getBalance() const
+	{
+		//no lock, retry if a write slipped in
+		uint64_t s;
+		double b;
+		do
+		{
+			s = mySeq.readBegin();
+			b = balance.load(std::memory_order_relaxed);
+		} while (mySeq.readRetry(s));
+		return b;
+	}
+};
+
 void threadFunc()
 {
 	std::cout << "Hello World " << std::this_thread::get_id() << "\n";
@@ -242,6 +308,172 @@ void testBankAccLockedAuto()
 	std::cout << "Time Elapsed" << seconds << "\n";
 }
 
+void testBankAccSeqLocked()
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	BankAccountSeqLocked bankAcc;
+	bankAcc.deposit(800);
+	int t_size = 2;
+	std::vector<std::thread> myThreads(t_size);
+	for (int i = 0; i < t_size; ++i)
+		myThreads[i] = std::thread(&BankAccountSeqLocked::withdraw, &bankAcc, 500); //we pass reference
+
+	//reporting thread is not held up by the 2s withdraws
+	std::thread reader([&bankAcc]()
+	{
+		for (int i = 0; i < 5; ++i)
+		{
+			std::cout << "Reported Balance " << bankAcc.getBalance() << "\n";
+			std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		}
+	});
+
+	for (int i = 0; i < t_size; ++i)
+		myThreads[i].join();
+	reader.join();
+	auto stop = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
+
+	std::cout << "Final Balace " << bankAcc.getBalance() << "\n";
+	std::cout << "Completed" << "\n";
+	std::cout << "Time Elapsed" << duration.count() << "\n";
+}
+
+void testLedgerReads()
+{
+	const size_t n_accounts = 64;
+	const double initial = 1000;
+	ledger book(n_accounts);
+	for (size_t i = 0; i < n_accounts; ++i)
+		book.deposit(i, initial);
+
+	std::atomic<bool> stop(false);
+	std::atomic<long> reads(0), bad(0);
+
+	//writers shuffle money around, the total never changes
+	auto writer = [&book, &stop, n_accounts](unsigned seed)
+	{
+		while (!stop)
+		{
+			seed = seed * 1103515245 + 12345;
+			size_t from = (seed >> 8) % n_accounts;
+			size_t to = (seed >> 16) % n_accounts;
+			book.transfer(from, to, (seed >> 24) % 100);
+		}
+	};
+
+	//readers check that every snapshot adds up
+	auto reader = [&book, &stop, &reads, &bad, n_accounts, initial]()
+	{
+		while (!stop)
+		{
+			if (book.totalBalance(0, n_accounts) != initial * n_accounts) ++bad;
+			++reads;
+		}
+	};
+
+	std::vector<std::thread> myThreads;
+	for (unsigned i = 0; i < 2; ++i)
+		myThreads.push_back(std::thread(writer, i + 1));
+	for (int i = 0; i < 4; ++i)
+		myThreads.push_back(std::thread(reader));
+
+	std::this_thread::sleep_for(std::chrono::seconds(1));
+	stop = true;
+	for (auto& t : myThreads)
+		t.join();
+
+	std::cout << "Snapshots " << reads << " inconsistent " << bad << "\n";
+	std::cout << "Total " << book.totalBalance(0, n_accounts) << "\n";
+}
+
+void testAdaptiveMutex()
+{
+	const int n_threads = 4;
+	const int n_ops = 200000;
+
+	//same tiny critical section as deposit, std::mutex vs adaptiveMutex
+	{
+		double balance = 0;
+		std::mutex myMutex;
+		auto f_ = [&balance, &myMutex, n_ops]()
+		{
+			for (int i = 0; i < n_ops; ++i)
+			{
+				std::lock_guard<std::mutex> lg(myMutex);
+				balance += 1;
+			}
+		};
+		auto start = std::chrono::high_resolution_clock::now();
+		std::vector<std::thread> myThreads(n_threads);
+		for (int i = 0; i < n_threads; ++i)
+			myThreads[i] = std::thread(f_);
+		for (int i = 0; i < n_threads; ++i)
+			myThreads[i].join();
+		std::chrono::duration<double, std::nano> dur = std::chrono::high_resolution_clock::now() - start;
+		std::cout << "std::mutex " << dur.count() / (n_threads * n_ops) << " ns per op, balance " << balance << "\n";
+	}
+	{
+		double balance = 0;
+		adaptiveMutex myMutex;
+		auto f_ = [&balance, &myMutex, n_ops]()
+		{
+			for (int i = 0; i < n_ops; ++i)
+			{
+				std::lock_guard<adaptiveMutex> lg(myMutex);
+				balance += 1;
+			}
+		};
+		auto start = std::chrono::high_resolution_clock::now();
+		std::vector<std::thread> myThreads(n_threads);
+		for (int i = 0; i < n_threads; ++i)
+			myThreads[i] = std::thread(f_);
+		for (int i = 0; i < n_threads; ++i)
+			myThreads[i].join();
+		std::chrono::duration<double, std::nano> dur = std::chrono::high_resolution_clock::now() - start;
+		std::cout << "adaptiveMutex " << dur.count() / (n_threads * n_ops) << " ns per op, balance " << balance << "\n";
+	}
+}
+
+void testLockProfiler()
+{
+	lockProfiler::getInstance()->enable();
+
+	double balance = 0;
+	adaptiveMutex depositMutex("deposit");
+	adaptiveMutex withdrawMutex("withdraw");
+
+	auto deposit = [&balance, &depositMutex]()
+	{
+		for (int i = 0; i < 10000; ++i)
+		{
+			siteLockGuard<adaptiveMutex> lg(depositMutex, LOCK_SITE);
+			balance += 1;
+		}
+	};
+	auto withdraw = [&withdrawMutex]()
+	{
+		for (int i = 0; i < 5; ++i)
+		{
+			siteLockGuard<adaptiveMutex> lg(withdrawMutex, LOCK_SITE);
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+	};
+
+	std::vector<std::thread> myThreads;
+	for (int i = 0; i < 3; ++i)
+	{
+		myThreads.push_back(std::thread(deposit));
+		myThreads.push_back(std::thread(withdraw));
+	}
+	for (auto& t : myThreads)
+		t.join();
+
+	std::cout << "Balance " << balance << "\n";
+	lockProfiler::getInstance()->report(std::cout);
+	lockProfiler::getInstance()->enable(false);
+}
+
 void LinearSearchThreads()
 {
 	int n = 10;
@@ -250,12 +482,13 @@ void LinearSearchThreads()
 	int i_thread = 0; //thread counter
 	int num_threads = 2;
 
-	bool result = false;
+	std::atomic<bool> result(false); //several threads may find the key
+	std::mutex myMutex; //shared, a mutex local to each thread locks nothing
 
 	//define func for each thread
-	auto f_ = [&i_thread, &result, v, num_threads](const double key)
+	auto f_ = [&i_thread, &result, &myMutex, &v, num_threads](const double key)
 	{
-		std::mutex myMutex; //we need to lock the global counter
+		//we need to lock the global counter
 		myMutex.lock();
 		int i_t = ++i_thread;
 		myMutex.unlock();
@@ -271,7 +504,7 @@ void LinearSearchThreads()
 		{
 			std::cout << "Thread ID " << std::this_thread::get_id() << " vec el " << i  << "\n";
 			if (v[i] == key)
-				result = true; //no need to lock here
+				result = true; //atomic store
 		}
 	};
 
@@ -333,10 +566,16 @@ void NumberInSequence2()
 	auto f_odd = [&i_thread, &myMutex, i_max, &cv1 /*&cv2*/]()
 	{
 		//std::lock_guard<std::mutex> lg(myMutex);
-		while (i_thread < i_max)
+		while (true)
 		{
-			//we need to lock the global counter
+			//we need to lock the global counter, the loop test reads it too
 			std::unique_lock<std::mutex> lock(myMutex);
+			if (i_thread >= i_max)
+			{
+				lock.unlock();
+				cv1.notify_one();
+				break;
+			}
 			//cv1.wait(lock);
 			if (i_thread % 2 != 0)
 			{
@@ -361,10 +600,16 @@ void NumberInSequence2()
 	auto f_even = [&i_thread, &myMutex, i_max, &cv1/*, &cv2*/]()
 	{
 		//std::lock_guard<std::mutex> lg(myMutex);
-		while (i_thread < i_max)
+		while (true)
 		{
-			//we need to lock the global counter
+			//we need to lock the global counter, the loop test reads it too
 			std::unique_lock<std::mutex> lock(myMutex);
+			if (i_thread >= i_max)
+			{
+				lock.unlock();
+				cv1.notify_one();
+				break;
+			}
 			//cv2.wait(lock);
 			if (i_thread % 2 == 0)
 			{
@@ -402,6 +647,101 @@ void NumberInSequence2()
 
 }
 
+void NumberInSequence3()
+{
+	//same as NumberInSequence2, but the turn is handed over explicitly
+	int i_thread = 0; //only touched by the thread holding the turn
+	int i_max = 20;
+	int num_threads = 3;
+	sequencer seq(num_threads);
+
+	auto f_ = [&i_thread, &seq, i_max](const size_t me)
+	{
+		while (true)
+		{
+			seq.wait(me);
+			if (i_thread >= i_max)
+			{
+				seq.pass(me); //let the others see the end too
+				return;
+			}
+			std::cout << "Thread ID " << std::this_thread::get_id() << " turn " << me << " i_t " << i_thread << "\n";
+			++i_thread;
+			seq.pass(me);
+		}
+	};
+
+	std::cout << "Start of integer sequence " << "\n";
+	std::vector<std::thread> myThreads(num_threads);
+	for (int i = 0; i < num_threads; ++i)
+		myThreads[i] = std::thread(f_, i);
+
+	for (int i = 0; i < num_threads; ++i)
+		myThreads[i].join();
+}
+
+void handoffLatency()
+{
+	const int handoffs = 200000;
+
+	//mutex + single condition_variable, the NumberInSequence2 way
+	{
+		std::mutex myMutex;
+		std::condition_variable cv1;
+		int turn = 0;
+		auto f_ = [&myMutex, &cv1, &turn, handoffs](const int me)
+		{
+			for (int n = 0; n < handoffs / 2; ++n)
+			{
+				std::unique_lock<std::mutex> lock(myMutex);
+				while (turn != me) cv1.wait(lock);
+				turn = 1 - me;
+				lock.unlock();
+				cv1.notify_one();
+			}
+		};
+
+		auto start = std::chrono::high_resolution_clock::now();
+		std::thread t1(f_, 0), t2(f_, 1);
+		t1.join();
+		t2.join();
+		std::chrono::duration<double, std::nano> dur = std::chrono::high_resolution_clock::now() - start;
+		std::cout << "condition_variable handoff " << dur.count() / handoffs << " ns" << std::endl;
+	}
+
+	//sequencer, 2 and 4 participants
+	for (int num_threads : { 2, 4 })
+	{
+		sequencer seq(num_threads);
+		auto f_ = [&seq, handoffs, num_threads](const size_t me)
+		{
+			for (int n = 0; n < handoffs / num_threads; ++n)
+			{
+				seq.wait(me);
+				seq.pass(me);
+			}
+		};
+
+		auto start = std::chrono::high_resolution_clock::now();
+		std::vector<std::thread> myThreads(num_threads);
+		for (int i = 0; i < num_threads; ++i)
+			myThreads[i] = std::thread(f_, i);
+		for (int i = 0; i < num_threads; ++i)
+			myThreads[i].join();
+		std::chrono::duration<double, std::nano> dur = std::chrono::high_resolution_clock::now() - start;
+		std::cout << "sequencer handoff, " << num_threads << " threads " << dur.count() / handoffs << " ns" << std::endl;
+	}
+}
+
+void stressTests()
+{
+	stressConfig cfg;
+	cfg.duration = std::chrono::milliseconds(500);
+	cfg.threads = 4;
+	bool ok = runStressTests(cfg);
+	std::cout << (ok ? "All stress tests passed" : "Stress tests FAILED") << "\n";
+}
+
 void testMoveOper()
 {
 	class A
@@ -499,8 +839,8 @@ void matrixMultiply()
 	m2.myVector = v;
 
 	auto start = std::chrono::system_clock::now();
-	//do multiplication
-	matrix<double> res = matrixProduct(m, m2);
+	//do multiplication, textbook i-j-k
+	matrix<double> res = matrixProductNaive(m, m2);
 	
 	std::chrono::duration<double> dur = std::chrono::system_clock::now() - start;
 	std::cout << "Time for addition " << dur.count() << " seconds" << std::endl;
@@ -528,6 +868,528 @@ void matrixMultiply()
 
 }
 
+void sparseMatrixMultiply()
+{
+	int rows = 1000;
+	int cols = 1000;
+
+	//~2% nonzeros, skewed towards the first rows so that row count != nnz balance
+	matrix<double> m(rows, cols);
+	for (int i = 0; i < rows; ++i)
+	{
+		int stride = i < rows / 10 ? 5 : 100;
+		for (int j = (i % stride); j < cols; j += stride)
+			m[i][j] = 1.5;
+	}
+
+	std::vector<double> v(rows * cols, 1.5);
+	matrix<double> m2(rows, cols);
+	m2.myVector = v;
+
+	csrMatrix<double> a = toCSR(m);
+	cscMatrix<double> ac = toCSC(a);
+	std::cout << "Nonzeros " << a.nnz() << " of " << rows * cols << std::endl;
+
+	auto start = std::chrono::system_clock::now();
+	matrix<double> res = matrixProduct2(m, m2);
+	std::chrono::duration<double> dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for dense product " << dur.count() << " seconds" << std::endl;
+	std::cout << "Matrix result " << std::accumulate(res.myVector.begin(), res.myVector.end(), 0.0) << std::endl;
+
+	start = std::chrono::system_clock::now();
+	matrix<double> res2 = spmm(a, m2);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for CSR SpMM " << dur.count() << " seconds" << std::endl;
+	std::cout << "Matrix result " << std::accumulate(res2.myVector.begin(), res2.myVector.end(), 0.0) << std::endl;
+
+	start = std::chrono::system_clock::now();
+	matrix<double> res3 = spmmMT(a, m2);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for CSR SpMM MT " << dur.count() << " seconds" << std::endl;
+	std::cout << "Matrix result " << std::accumulate(res3.myVector.begin(), res3.myVector.end(), 0.0) << std::endl;
+
+	start = std::chrono::system_clock::now();
+	matrix<double> res4 = spmmMT(ac, m2);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for CSC SpMM MT " << dur.count() << " seconds" << std::endl;
+	std::cout << "Matrix result " << std::accumulate(res4.myVector.begin(), res4.myVector.end(), 0.0) << std::endl;
+
+	std::vector<double> x(cols, 1.5);
+	std::vector<double> y = spmvMT(a, x);
+	std::vector<double> yc = spmvMT(ac, x);
+	std::cout << "SpMV result CSR " << std::accumulate(y.begin(), y.end(), 0.0)
+		<< " CSC " << std::accumulate(yc.begin(), yc.end(), 0.0) << std::endl;
+}
+
+void mixedPrecisionMultiply()
+{
+	int rows = 1000;
+	int cols = 1000;
+
+	matrix<double> md(rows, cols);
+	for (int i = 0; i < rows; ++i)
+		for (int j = 0; j < cols; ++j)
+			md[i][j] = 0.001 * ((i + j) % 7);
+
+	//vectorized conversions
+	matrix<float> mf(md);
+	matrix<bfloat16> mb(mf);
+	matrix<half> mh(mf);
+	matrix<int8_t> mi(rows, cols);
+	for (int i = 0; i < rows; ++i)
+		for (int j = 0; j < cols; ++j)
+			mi[i][j] = static_cast<int8_t>((i + j) % 7);
+
+	auto start = std::chrono::system_clock::now();
+	matrix<double> resd = matrixProduct2(md, md);
+	std::chrono::duration<double> dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for double " << dur.count() << " seconds" << std::endl;
+	std::cout << "Matrix result " << std::accumulate(resd.begin(), resd.end(), 0.0) << std::endl;
+
+	start = std::chrono::system_clock::now();
+	matrix<float> resf = matrixProduct2(mf, mf);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for float " << dur.count() << " seconds" << std::endl;
+	std::cout << "Matrix result " << std::accumulate(resf.begin(), resf.end(), 0.0) << std::endl;
+
+	start = std::chrono::system_clock::now();
+	matrix<float> resb = matrixProductAcc<float>(mb, mb);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for bf16 in fp32 " << dur.count() << " seconds" << std::endl;
+	std::cout << "Matrix result " << std::accumulate(resb.begin(), resb.end(), 0.0) << std::endl;
+
+	start = std::chrono::system_clock::now();
+	matrix<float> resh = matrixProductAcc<float>(mh, mh);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for fp16 in fp32 " << dur.count() << " seconds" << std::endl;
+	std::cout << "Matrix result " << std::accumulate(resh.begin(), resh.end(), 0.0) << std::endl;
+
+	start = std::chrono::system_clock::now();
+	matrix<int32_t> resi = matrixProductAcc<int32_t>(mi, mi);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for int8 in int32 " << dur.count() << " seconds" << std::endl;
+	std::cout << "Matrix result " << std::accumulate(resi.begin(), resi.end(), 0.0) << std::endl;
+
+	//int8 results narrow back saturating, at and just past both ends of the range
+	matrix<int8_t> a8(1, 4), b8(4, 5);
+	const int8_t a8v[] = { 127, 1, 120, -128 };
+	const int8_t b8v[] = {
+		1, 1, 127, 0, 0,
+		0, 1, 127, -1, 0,
+		0, 0, 127, 0, 0,
+		0, 0, 0, 1, 1 };
+	std::copy(a8v, a8v + 4, a8.begin());
+	std::copy(b8v, b8v + 20, b8.begin());
+	const int expected[] = { 127, 127, 127, -128, -128 };    //  127, 128, 31496, -129, -128 before narrowing
+	for (const matrix<int8_t>& r8 : { matrixProduct(a8, b8), matrixProduct2(a8, b8), matrixProductNaive(a8, b8) })
+	{
+		bool ok = true;
+		for (size_t j = 0; j < 5; ++j) ok = ok && r8[0][j] == expected[j];
+		std::cout << "Saturated int8 product " << (ok ? "OK" : "FAILED") << std::endl;
+	}
+}
+
+void outOfCoreMultiply()
+{
+	int rows = 1000;
+	int cols = 1000;
+
+	matrix<double> m(rows, cols);
+	for (int i = 0; i < rows; ++i)
+		for (int j = 0; j < cols; ++j)
+			m[i][j] = 0.001 * ((i + 2 * j) % 11);
+
+	writeMatrixFile("m1.mat", m);
+	writeMatrixFile("m2.mat", m);
+
+	//no copy, pages come from the file
+	matrix_view<double> view("m1.mat");
+	std::cout << "Mapped " << view.rows() << " x " << view.cols() << " sum " << std::accumulate(view.begin(), view.end(), 0.0) << std::endl;
+
+	auto start = std::chrono::system_clock::now();
+	matrixProductOutOfCore<double>("m1.mat", "m2.mat", "res.mat");
+	std::chrono::duration<double> dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for out of core product " << dur.count() << " seconds" << std::endl;
+
+	matrix_view<double> res("res.mat");
+	std::cout << "Matrix result " << std::accumulate(res.begin(), res.end(), 0.0) << std::endl;
+
+	matrix<double> res2 = matrixProduct2(m, m);
+	std::cout << "In memory result " << std::accumulate(res2.begin(), res2.end(), 0.0) << std::endl;
+}
+
+void asyncMatrixMultiply()
+{
+	ThreadPool::getInstance()->start();
+
+	int rows = 500;
+	int cols = 500;
+
+	std::vector<double> v(rows * cols, 1.5);
+	matrix<double> a(rows, cols), b(rows, cols), e(rows, cols);
+	a.myVector = v;
+	b.myVector = v;
+	e.myVector = v;
+
+	auto start = std::chrono::system_clock::now();
+	//C = A*B; D = transpose(C)*E and, independently, F = A*E
+	//nothing blocks until get()
+	asyncFuture<matrix<double>> c = matrixProductAsync(a, b);
+	asyncFuture<matrix<double>> d = matrixProductAsync(transposeAsync(c), makeReadyFuture(e));
+	asyncFuture<matrix<double>> f = matrixProductAsync(a, e);
+	asyncFuture<double> sum = when_all(d, f).then([](const std::tuple<asyncFuture<matrix<double>>, asyncFuture<matrix<double>>>& in)
+	{
+		const matrix<double>& dd = std::get<0>(in).get();
+		const matrix<double>& ff = std::get<1>(in).get();
+		return std::accumulate(dd.begin(), dd.end(), 0.0) + std::accumulate(ff.begin(), ff.end(), 0.0);
+	});
+	std::cout << "Graph built" << std::endl;
+
+	double res = sum.get();
+	std::chrono::duration<double> dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for async graph " << dur.count() << " seconds" << std::endl;
+	std::cout << "Matrix result " << res << std::endl;
+
+	//continuations may return void, and stop() runs what is still queued, so no get() hangs
+	asyncFuture<void> printed = sum.then([](const double s) { std::cout << "Continuation saw " << s << std::endl; });
+	asyncFuture<double> late = printed.then([&a]() { return std::accumulate(a.begin(), a.end(), 0.0); });
+	ThreadPool::getInstance()->stop();
+	printed.get();
+	std::cout << "After stop " << late.get() << std::endl;
+}
+
+void matrixOperations()
+{
+	ThreadPool::getInstance()->start();
+
+	int rows = 2000;
+	int cols = 2000;
+
+	matrix<double> x(rows, cols), y(rows, cols);
+
+	auto start = std::chrono::system_clock::now();
+	fill(x, 1.5);
+	fill(y, 2.0);
+	axpy(2.0, x, y); //y = 5
+	scale(y, 0.5); //y = 2.5
+	mapInPlace(x, [](double v) { return v * v; }); //x = 2.25
+	y[7][11] = 10;
+	std::chrono::duration<double> dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for element-wise ops " << dur.count() << " seconds" << std::endl;
+
+	start = std::chrono::system_clock::now();
+	std::vector<double> rs = rowSums(y);
+	std::vector<double> cs = colSums(y);
+	std::vector<double> cm = colMax(y);
+	std::vector<size_t> ra = rowArgmax(y);
+	std::vector<size_t> ca = colArgmax(y);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for reductions " << dur.count() << " seconds" << std::endl;
+
+	std::cout << "Sum x " << std::accumulate(x.begin(), x.end(), 0.0) << std::endl;
+	std::cout << "Row sums " << std::accumulate(rs.begin(), rs.end(), 0.0)
+		<< " col sums " << std::accumulate(cs.begin(), cs.end(), 0.0) << std::endl;
+	std::cout << "Max in col 11 " << cm[11] << " at row " << ca[11] << ", argmax of row 7 " << ra[7] << std::endl;
+
+	//a throwing chunk, inline or on the pool, surfaces once every chunk is done
+	for (const size_t bad : { size_t(0), x.myVector.size() - 1 })
+	{
+		try
+		{
+			mapInPlace(x, [&x, bad](const double& v) -> double { if (&v == &x.myVector[bad]) throw std::runtime_error("bad element"); return v; });
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << "Caught " << e.what() << " at " << bad << std::endl;
+		}
+	}
+
+	ThreadPool::getInstance()->stop();
+}
+
+void batchedMultiply()
+{
+	ThreadPool::getInstance()->start();
+
+	for (int size : { 4, 16, 64 })
+	{
+		int batch = 20000 / size;
+
+		std::vector<matrix<double>> a(batch, matrix<double>(size, size)), b(batch, matrix<double>(size, size));
+		for (int n = 0; n < batch; ++n)
+		{
+			fill(a[n], 1.5);
+			fill(b[n], 0.5 + n % 3);
+		}
+
+		//one call per product
+		auto start = std::chrono::system_clock::now();
+		double res1 = 0;
+		for (int n = 0; n < batch; ++n)
+		{
+			matrix<double> c = matrixProduct(a[n], b[n]);
+			res1 += c[0][0];
+		}
+		std::chrono::duration<double> dur = std::chrono::system_clock::now() - start;
+		std::cout << size << "x" << size << " x " << batch << " one by one " << dur.count() << " seconds" << std::endl;
+
+		//batched, output storage reused on the second call
+		std::vector<matrix<double>> c;
+		batchedProduct(a, b, c);
+		start = std::chrono::system_clock::now();
+		batchedProduct(a, b, c);
+		dur = std::chrono::system_clock::now() - start;
+		double res2 = 0;
+		for (int n = 0; n < batch; ++n)
+			res2 += c[n][0][0];
+		std::cout << size << "x" << size << " x " << batch << " batched " << dur.count() << " seconds" << std::endl;
+		std::cout << "Results " << res1 << " " << res2 << std::endl;
+	}
+
+	//strided buffer, all A[i] times the same B
+	int batch = 10000;
+	std::vector<float> a(batch * 16, 1.0f), b(16, 2.0f), c(batch * 16);
+	batchedProductStrided<4, 4, 4>(a.data(), 16, b.data(), 0, c.data(), 16, batch);
+	std::cout << "Strided result " << std::accumulate(c.begin(), c.end(), 0.0) << std::endl;
+
+	ThreadPool::getInstance()->stop();
+}
+
+void priorityScheduling()
+{
+	//one worker kept for critical tasks, three for anything
+	ThreadPool* pool = ThreadPool::getInstance();
+	pool->reserveWorkers(priorityCritical, 1);
+	pool->start(4);
+
+	for (taskPriority p : { priorityBatch, priorityCritical })
+	{
+		//flood the pool with 10ms batch jobs
+		std::vector<TaskHandle> batch;
+		for (int n = 0; n < 100; ++n)
+		{
+			batch.push_back(pool->spawnTask([]()
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				return true;
+			}, priorityBatch));
+		}
+
+		//then small jobs, measured from submission to start
+		//critical ones with a deadline, run earliest first among themselves
+		std::vector<std::chrono::steady_clock::time_point> submitted(20), started(20);
+		std::vector<TaskHandle> small;
+		for (int n = 0; n < 20; ++n)
+		{
+			submitted[n] = std::chrono::steady_clock::now();
+			small.push_back(pool->spawnTask([&started, n]()
+			{
+				started[n] = std::chrono::steady_clock::now();
+				return true;
+			}, p, p == priorityBatch ? schedulingQueue<Task>::noDeadline : submitted[n] + std::chrono::milliseconds(20)));
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		for (TaskHandle& f : small) pool->activeWait(f);
+		for (TaskHandle& f : batch) pool->activeWait(f);
+
+		double total = 0;
+		for (int n = 0; n < 20; ++n)
+			total += std::chrono::duration<double>(started[n] - submitted[n]).count();
+		std::cout << (p == priorityBatch ? "Small jobs queued as batch" : "Small jobs queued as critical")
+			<< ", mean wait " << total / 20 * 1000 << " ms" << std::endl;
+	}
+
+	pool->stop();
+	pool->reserveWorkers(priorityCritical, 0);
+}
+
+void autoTunedMultiply()
+{
+	//tunes double up front, or reads the profile left by an earlier run on this host
+	kernelTuner* tuner = kernelTuner::getInstance();
+	tuner->setProfilePath("matrixProduct.profile");
+
+	auto start = std::chrono::system_clock::now();
+	tuner->tune<double>();
+	std::chrono::duration<double> dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for tuning or loading the profile " << dur.count() << " seconds" << std::endl;
+	tuner->report(std::cout);
+
+	for (int size : { 50, 300, 1000 })
+	{
+		std::vector<double> v(size * size, 1.5);
+		matrix<double> m(size, size);
+		m.myVector = v;
+
+		start = std::chrono::system_clock::now();
+		matrix<double> res = matrixProduct(m, m);
+		dur = std::chrono::system_clock::now() - start;
+		kernelChoice c = tuner->choose<double>(size, size, size);
+		std::cout << size << "x" << size << " dispatched to " << kernelName(c.kernel) << " block " << c.block
+			<< " threads " << c.threads << ", " << dur.count() << " seconds" << std::endl;
+
+		start = std::chrono::system_clock::now();
+		matrix<double> res2 = matrixProduct2(m, m);
+		dur = std::chrono::system_clock::now() - start;
+		std::cout << size << "x" << size << " matrixProduct2 " << dur.count() << " seconds" << std::endl;
+		std::cout << "Results " << std::accumulate(res.begin(), res.end(), 0.0) << " "
+			<< std::accumulate(res2.begin(), res2.end(), 0.0) << std::endl;
+	}
+}
+
+void pipelineStages()
+{
+	//text in, parsed, a slow transform, then a cheap one; output in input order
+	pipeline<std::string> source(256);
+	auto p = std::move(source)
+		.then("parse", [](const std::string& s) { return std::stod(s); })
+		.then("transform", [](double x)
+		{
+			double y = x;
+			for (int n = 0; n < 2000; ++n) y = std::sqrt(y * y + 1.0);
+			return std::make_pair(x, y);
+		}, stageOptions(4))
+		.then("difference", [](const std::pair<double, double>& xy)
+		{
+			return std::make_pair(static_cast<long>(xy.first), xy.second - xy.first);
+		}, stageOptions(1, true, 1024));
+
+	auto start = std::chrono::system_clock::now();
+	p.start();
+	std::thread producer([&p]()
+	{
+		for (int n = 0; n < 200000; ++n) p.push(std::to_string(n % 1000));
+		p.close();
+	});
+
+	long count = 0;
+	double sum = 0;
+	bool inOrder = true;
+	while (std::optional<std::pair<long, double>> v = p.pop())
+	{
+		inOrder = inOrder && v->first == count % 1000;
+		sum += v->second;
+		++count;
+	}
+	producer.join();
+	p.wait();
+
+	std::chrono::duration<double> dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for pipeline " << dur.count() << " seconds" << std::endl;
+	std::cout << count << " items, sum " << sum << (inOrder ? ", in order" : ", out of order") << std::endl;
+	p.report(std::cout);
+
+	//a bad line stops the pipeline, and its exception reaches the consumer
+	pipeline<std::string> source2(16);
+	auto q = std::move(source2).then("parse", [](const std::string& s) { return std::stod(s); });
+	q.start();
+	std::thread producer2([&q]()
+	{
+		for (int n = 0; n < 100000; ++n) if (!q.push(n == 500 ? "bad" : std::to_string(n))) break;
+		q.close();
+	});
+	count = 0;
+	try
+	{
+		while (q.pop()) ++count;
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << "Pipeline stopped after " << count << " items: " << e.what() << std::endl;
+	}
+	producer2.join();
+	try { q.wait(); } catch (const std::exception&) {}
+}
+
+void layoutMultiply()
+{
+	int rows = 1000;
+	int cols = 1000;
+
+	std::vector<double> v(rows * cols, 1.5);
+	matrix<double> m(rows, cols);
+	m.myVector = v;
+
+	//conversions, each a single pass
+	auto start = std::chrono::system_clock::now();
+	matrix<double, colMajor> mc(m);
+	matrix<double, tileMajor<>> mt(m);
+	std::chrono::duration<double> dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for layout conversions " << dur.count() << " seconds" << std::endl;
+
+	start = std::chrono::system_clock::now();
+	matrix<double> res = matrixProduct2(m, m);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for row x row " << dur.count() << " seconds, result " << std::accumulate(res.begin(), res.end(), 0.0) << std::endl;
+
+	//columns of the right hand side contiguous: dot products
+	start = std::chrono::system_clock::now();
+	matrix<double> res2 = matrixProduct(m, mc);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for row x col " << dur.count() << " seconds, result " << std::accumulate(res2.begin(), res2.end(), 0.0) << std::endl;
+
+	start = std::chrono::system_clock::now();
+	matrix<double, colMajor> res3 = matrixProduct(mc, mc);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for col x col " << dur.count() << " seconds, result " << std::accumulate(res3.begin(), res3.end(), 0.0) << std::endl;
+
+	//every tile contiguous, three tiles in cache at a time
+	start = std::chrono::system_clock::now();
+	matrix<double, tileMajor<>> res4 = matrixProduct(mt, mt);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for tile x tile " << dur.count() << " seconds, result " << std::accumulate(res4.begin(), res4.end(), 0.0) << std::endl;
+
+	start = std::chrono::system_clock::now();
+	matrix<double> t = transpose(m);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for transpose " << dur.count() << " seconds" << std::endl;
+
+	start = std::chrono::system_clock::now();
+	matrix<double, tileMajor<>> tt = transpose(mt);
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for tiled transpose " << dur.count() << " seconds" << std::endl;
+
+	//no copy at all, the storage is reinterpreted
+	start = std::chrono::system_clock::now();
+	matrix<double, colMajor> tc = asTransposed(std::move(t));
+	dur = std::chrono::system_clock::now() - start;
+	std::cout << "Time for asTransposed " << dur.count() << " seconds, " << tc.rows() << " x " << tc.cols() << std::endl;
+
+	//int8 accumulates in int32 and saturates whatever the layouts, as in row-major
+	matrix<int8_t> a8(37, 45), b8(45, 29);
+	for (size_t i = 0; i < a8.myVector.size(); ++i) a8.myVector[i] = static_cast<int8_t>(i * 37 % 255 - 127);
+	for (size_t i = 0; i < b8.myVector.size(); ++i) b8.myVector[i] = static_cast<int8_t>(i * 53 % 255 - 127);
+	const matrix<int8_t> r8 = matrixProduct(a8, b8);
+	const matrix<int8_t, colMajor> a8c(a8), b8c(b8);
+	const matrix<int8_t, tileMajor<16>> a8t(a8), b8t(b8);
+	const bool same = matrix<int8_t>(matrixProduct(a8, b8c)).myVector == r8.myVector
+		&& matrix<int8_t>(matrixProduct(a8c, b8)).myVector == r8.myVector
+		&& matrix<int8_t>(matrixProduct(a8c, b8c)).myVector == r8.myVector
+		&& matrix<int8_t>(matrixProduct(a8t, b8t)).myVector == r8.myVector;
+	std::cout << "int8 products across layouts " << (same ? "match" : "DIFFER") << std::endl;
+
+	//narrowing saturates whatever the target layout
+	matrix<double> w(1, 2);
+	w[0][0] = 300;
+	w[0][1] = -300;
+	const matrix<int8_t> w8(w);
+	const matrix<int8_t, colMajor> w8c(w);
+	const matrix<int8_t, tileMajor<16>> w8t(w);
+	std::cout << "300, -300 to int8: row " << int(w8[0][0]) << ", " << int(w8[0][1])
+		<< " col " << int(w8c(0, 0)) << ", " << int(w8c(0, 1))
+		<< " tile " << int(w8t(0, 0)) << ", " << int(w8t(0, 1)) << std::endl;
+
+	//resizing keeps the storage, and zeroes the padding of the new edge tiles
+	matrix<double, tileMajor<>> r = mt;
+	r.resize(999, 999);
+	matrix<double, tileMajor<>> ones(999, 999);
+	for (size_t i = 0; i < 999; ++i) for (size_t j = 0; j < 999; ++j) ones(i, j) = 1.0;
+	matrix<double, tileMajor<>> rr = matrixProduct(r, ones);
+	std::cout << "Product after tiled resize " << std::accumulate(rr.begin(), rr.end(), 0.0)
+		<< ", expected " << 1.5 * 999 * 999 * 999 << std::endl;
+}
+
 void inheritanceTest()
 {
 	class Base {
@@ -698,11 +1560,28 @@ int main() {
 	//testBankAcc_copy(); //here we dont have as we pass copy of bank acc
 	//testBankAccLocked();// with mutex
 	//testBankAccLockedAuto();// auto release
+	//testBankAccSeqLocked();// lock-free reads
+	//testLedgerReads();
+	//testAdaptiveMutex();
+	//testLockProfiler();
 	//LinearSearchThreads();
 	//NumberInSequence();
 	//NumberInSequence2();
+	//NumberInSequence3();
+	//handoffLatency();
+	//stressTests();
 	//testMoveOper();
 	//matrixMultiply();
+	//sparseMatrixMultiply();
+	//mixedPrecisionMultiply();
+	//outOfCoreMultiply();
+	//asyncMatrixMultiply();
+	//matrixOperations();
+	//batchedMultiply();
+	//priorityScheduling();
+	//autoTunedMultiply();
+	//pipelineStages();
+	//layoutMultiply();
 	//testInheritance();
 	templatesFnc();
 
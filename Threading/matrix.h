@@ -3,18 +3,30 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
+#include <type_traits>
 #include <assert.h>
 //using namespace std;
 #include <thread>
 #include <mutex>
+#include "Precision.h"
+#include "MatrixLayout.h"
+#include "AdaptiveMutex.h"
+//  Only names the kernels below from templates, see matrixProduct at the end
+#include "KernelTuner.h"
 
 //  Simple matrix class that wraps a vector,
 //  See chapters 1 and 2
+//  Layout says where element (i, j) lives in the vector, see MatrixLayout.h
+//  Row-major is the default, and the only layout with [i][j] access
 
-template <class T>
+//  Layout defaults to rowMajor, see the declaration in MatrixLayout.h
+template <class T, class Layout>
 class matrix
 {
 public:
+	typedef Layout layout;
+
 	size_t      myRows;
 	size_t      myCols;
 	std::vector<T>   myVector;
@@ -23,41 +35,49 @@ public:
 
 	//  Constructors
 	matrix() : myRows(0), myCols(0) {}
-	matrix(const size_t rows, const size_t cols) : myRows(rows), myCols(cols), myVector(rows*cols) {}
+	matrix(const size_t rows, const size_t cols) : myRows(rows), myCols(cols), myVector(Layout::storage(rows, cols)) {}
 
 	//  Copy, assign
 	matrix(const matrix& rhs) : myRows(rhs.myRows), myCols(rhs.myCols), myVector(rhs.myVector) {}
 	matrix& operator=(const matrix& rhs)
 	{
 		if (this == &rhs) return *this;
-		matrix<T> temp(rhs);
+		matrix temp(rhs);
 		swap(temp);
 		return *this;
 	}
 
 	//  Copy, assign from different (convertible) type
 	template <class U>
-	matrix(const matrix<U>& rhs)
-		: myRows(rhs.rows()), myCols(rhs.cols())
+	matrix(const matrix<U, Layout>& rhs)
+		: myRows(rhs.rows()), myCols(rhs.cols()), myVector(rhs.myVector.size())
 	{
-		myVector.resize(rhs.rows() * rhs.cols());
-		copy(rhs.begin(), rhs.end(), myVector.begin());
+		convertRange(rhs.myVector.data(), myVector.size(), myVector.data());
 	}
 	template <class U>
-	matrix& operator=(const matrix<U>& rhs)
+	matrix& operator=(const matrix<U, Layout>& rhs)
 	{
-		if (this == &rhs) return *this;
-		matrix<T> temp(rhs);
+		//  Different types never alias
+		matrix temp(rhs);
 		swap(temp);
 		return *this;
 	}
 
+	//  Copy from another layout, explicit as it moves every element
+	//      matrix<double, colMajor> c(a);
+	template <class U, class L2, std::enable_if_t<!std::is_same<L2, Layout>::value, int> = 0>
+	explicit matrix(const matrix<U, L2>& rhs)
+		: myRows(rhs.rows()), myCols(rhs.cols()), myVector(Layout::storage(rhs.rows(), rhs.cols()))
+	{
+		convertStorage<L2, Layout>(rhs.myVector.data(), myVector.data(), myRows, myCols);
+	}
+
 	//  Move, move assign
-	matrix(matrix&& rhs) : myRows(rhs.myRows), myCols(rhs.myCols), myVector(move(rhs.myVector)) {}
+	matrix(matrix&& rhs) : myRows(rhs.myRows), myCols(rhs.myCols), myVector(std::move(rhs.myVector)) {}
 	matrix& operator=(matrix&& rhs)
 	{
 		if (this == &rhs) return *this;
-		matrix<T> temp(move(rhs));
+		matrix temp(std::move(rhs));
 		swap(temp);
 		return *this;
 	}
@@ -66,27 +86,52 @@ public:
 	void swap(matrix& rhs)
 	{
 		myVector.swap(rhs.myVector);
-		::swap(myRows, rhs.myRows);
-		::swap(myCols, rhs.myCols);
+		std::swap(myRows, rhs.myRows);
+		std::swap(myCols, rhs.myCols);
 	}
 
-	//  Resizer
+	//  Resizer, for scratch matrices: reuses the storage when large enough, in any layout
+	//  Existing elements are then kept as stored, not moved to their new (i, j),
+	//  only the padding of the new edge tiles is zeroed, kernels read whole tiles
+	//  A reallocation, when growing, starts from zeros
 	void resize(const size_t rows, const size_t cols)
 	{
 		myRows = rows;
 		myCols = cols;
-		if (myVector.size() < rows*cols) myVector = std::vector<T>(rows*cols);
+		if (myVector.size() < Layout::storage(rows, cols)) myVector = std::vector<T>(Layout::storage(rows, cols));
+		else if constexpr (isTileMajor<Layout>::value) clearPadding();
+	}
+
+	//  Zeroes what the edge tiles hold beyond rows x cols
+	template <class L = Layout, std::enable_if_t<isTileMajor<L>::value, int> = 0>
+	void clearPadding()
+	{
+		const size_t B = Layout::tile;
+		for (size_t ti = 0; ti < Layout::tilesDown(myRows); ++ti)
+			for (size_t tj = 0; tj < Layout::tilesAcross(myCols); ++tj)
+			{
+				const size_t i1 = std::min(B, myRows - ti * B), j1 = std::min(B, myCols - tj * B);
+				if (i1 == B && j1 == B) continue;
+				T* t = &myVector[Layout::tileOffset(ti, tj, myCols)];
+				for (size_t i = 0; i < B; ++i)
+					for (size_t j = i < i1 ? j1 : 0; j < B; ++j) t[i * B + j] = T(0);
+			}
 	}
 
 	//  Access
 	size_t rows() const { return myRows; }
 	size_t cols() const { return myCols; }
-	//  So we can call matrix [i][j]
+	//  So we can call matrix [i][j], row-major only
+	template <class L = Layout, std::enable_if_t<std::is_same<L, rowMajor>::value, int> = 0>
 	T* operator[] (const size_t row) { return &myVector[row*myCols]; }
+	template <class L = Layout, std::enable_if_t<std::is_same<L, rowMajor>::value, int> = 0>
 	const T* operator[] (const size_t row) const { return &myVector[row*myCols]; }
+	//  Any layout
+	T& operator() (const size_t i, const size_t j) { return myVector[Layout::index(i, j, myRows, myCols)]; }
+	const T& operator() (const size_t i, const size_t j) const { return myVector[Layout::index(i, j, myRows, myCols)]; }
 	bool empty() const { return myVector.empty(); }
 
-	//  Iterators
+	//  Iterators, over the storage in layout order, tile padding included
 	typedef typename std::vector<T>::iterator iterator;
 	typedef typename std::vector<T>::const_iterator const_iterator;
 	iterator begin() { return myVector.begin(); }
@@ -95,23 +140,58 @@ public:
 	const_iterator end() const { return myVector.end(); }
 };
 
+//  The transpose of a row-major matrix is its storage read col-major, and vice versa
+//  O(1), the storage moves over
+template <class T>
+inline matrix<T, colMajor> asTransposed(matrix<T, rowMajor>&& mat)
+{
+	matrix<T, colMajor> res;
+	res.myRows = mat.cols();
+	res.myCols = mat.rows();
+	res.myVector.swap(mat.myVector);
+	mat.myRows = mat.myCols = 0;
+	return res;
+}
+
 template <class T>
-inline matrix<T> transpose(const matrix<T>& mat)
+inline matrix<T, rowMajor> asTransposed(matrix<T, colMajor>&& mat)
+{
+	matrix<T, rowMajor> res;
+	res.myRows = mat.cols();
+	res.myCols = mat.rows();
+	res.myVector.swap(mat.myVector);
+	mat.myRows = mat.myCols = 0;
+	return res;
+}
+
+//  Same layout out as in
+//  Row and col-major transpose their storage in cache-sized blocks,
+//  tiled matrices move whole tiles and transpose each within cache
+template <class T, class L>
+inline matrix<T, L> transpose(const matrix<T, L>& mat)
 {
-	matrix<T> res(mat.cols(), mat.rows());
-	for (size_t i = 0; i < res.rows(); ++i)
+	matrix<T, L> res(mat.cols(), mat.rows());
+	if constexpr (std::is_same<L, rowMajor>::value)
+		transposeBlocked(mat.myVector.data(), mat.rows(), mat.cols(), res.myVector.data());
+	else if constexpr (std::is_same<L, colMajor>::value)
+		transposeBlocked(mat.myVector.data(), mat.cols(), mat.rows(), res.myVector.data());
+	else
 	{
-		for (size_t j = 0; j < res.cols(); ++j)
-		{
-			res[i][j] = mat[j][i];
-		}
+		static_assert(isTileMajor<L>::value, "unknown layout");
+		const size_t B = L::tile;
+		for (size_t ti = 0; ti < L::tilesDown(mat.rows()); ++ti)
+			for (size_t tj = 0; tj < L::tilesAcross(mat.cols()); ++tj)
+				transposeBlocked(&mat.myVector[L::tileOffset(ti, tj, mat.cols())], B, B, &res.myVector[L::tileOffset(tj, ti, res.cols())]);
 	}
 
 	return res;
 }
 
-template <class T>
-matrix<T> matrixProduct(const matrix<T>& mat1, const matrix<T>& mat2)
+//  Acc is the accumulation type, by default accumulator_t<T>
+//  e.g. float accumulates in float, int8_t in int32_t, bfloat16 in float
+//  i-j-k, the textbook loop, see matrixProduct below for the dispatching version
+template <class T, class Acc = accumulator_t<T>>
+matrix<T> matrixProductNaive(const matrix<T>& mat1, const matrix<T>& mat2)
 {
 	assert(mat1.cols() == mat2.rows());
 	matrix<T> res(mat1.rows(), mat2.cols());
@@ -121,15 +201,15 @@ matrix<T> matrixProduct(const matrix<T>& mat1, const matrix<T>& mat2)
 		for (size_t j = 0; j < mat2.cols(); ++j)
 		{
 			//now iterate ovet the cols and add to the res
-			double x = 0;
+			Acc x = 0;
 			//now another loop
 			for (size_t k = 0; k < mat1.cols(); ++k)
 			{
-				x += mat1[i][k] * mat2[k][j];
+				x += static_cast<Acc>(mat1[i][k]) * static_cast<Acc>(mat2[k][j]);
 				//mat1[i][k] is local , successive aik are local in memory
 				//successive mat2[k][j] are not local, but some 1000 doubles (or the size of the matrix2)
 			}
-			res[i][j] = x;
+			res[i][j] = narrowCast<T>(x);
 		}
 
 	}
@@ -137,73 +217,243 @@ matrix<T> matrixProduct(const matrix<T>& mat1, const matrix<T>& mat2)
 	return res;//std::move 
 }
 
-template <class T>
-matrix<T> matrixProduct2(const matrix<T>& mat1, const matrix<T>& mat2)
+//  Product of T inputs accumulated and returned in Acc, no narrowing of the result
+//  Use for inference style products, e.g. matrixProductAcc<int32_t>(int8 matrices)
+template <class Acc, class T>
+matrix<Acc> matrixProductAcc(const matrix<T>& mat1, const matrix<T>& mat2)
 {
 	assert(mat1.cols() == mat2.rows());
-	matrix<T> res(mat1.rows(), mat2.cols());
+	matrix<Acc> res(mat1.rows(), mat2.cols());
 
-	for (size_t i = 0; i < mat1.rows(); ++i)
-	{		
-		for (size_t j = 0; j < mat2.cols(); ++j)
-			res[i][j] = 0;//init
-	}	
+	//  Inner loop runs on Acc only, so it vectorizes at the accumulator width
+	//  Narrower inputs are widened once up front instead of in the inner loop
+	auto kernel = [&res, &mat1](const auto& wide2)
+	{
+		for (size_t i = 0; i < mat1.rows(); ++i)
+		{
+			Acc* ri = res[i];
+			for (size_t k = 0; k < mat1.cols(); ++k)
+			{
+				const Acc aik = static_cast<Acc>(mat1[i][k]);
+				const Acc* bk = wide2[k];
+				for (size_t j = 0; j < wide2.cols(); ++j)
+					ri[j] += aik * bk[j];
+			}
+		}
+	};
 
-	for (size_t i = 0; i < mat1.rows(); ++i)
+	if constexpr (std::is_same<T, Acc>::value) kernel(mat2);
+	else kernel(matrix<Acc>(mat2));
+
+	return res;
+}
+
+template <class T, class Acc = accumulator_t<T>>
+matrix<T> matrixProduct2(const matrix<T>& mat1, const matrix<T>& mat2)
+{
+	//  Accumulate wide, narrow once at the end, saturating integers
+	if constexpr (!std::is_same<T, Acc>::value)
+		return matrix<T>(matrixProductAcc<Acc>(mat1, mat2));
+	else
 	{
-		for (size_t k = 0; k < mat1.cols(); ++k)
+		assert(mat1.cols() == mat2.rows());
+		//  std::vector value-initializes, res is already zero
+		matrix<T> res(mat1.rows(), mat2.cols());
+
+		for (size_t i = 0; i < mat1.rows(); ++i)
 		{
-			//#pragma loop(no_vector) - cancel vectorization
-			for (size_t j = 0; j < mat2.cols(); ++j)
-				res[i][j] += mat1[i][k] * mat2[k][j];
+			for (size_t k = 0; k < mat1.cols(); ++k)
+			{
+				//#pragma loop(no_vector) - cancel vectorization
+				for (size_t j = 0; j < mat2.cols(); ++j)
+					res[i][j] += mat1[i][k] * mat2[k][j];
+			}
 		}
+
+		return res;//std::move 
 	}
+}
 
-	return res;//std::move 
+
+//  Rows [iBegin, iEnd) of c += a * b, i-k-j, all row-major, a is . x kEnd, b is kEnd x jEnd
+//  With block > 0, b is walked in block x block tiles that stay in cache
+//  across all the rows, instead of streaming all of b once per row
+template <class T>
+inline void productRows(const T* a, const T* b, T* c, const size_t kEnd, const size_t jEnd,
+	const size_t iBegin, const size_t iEnd, const size_t block)
+{
+	const size_t stepK = block ? block : kEnd, stepJ = block ? block : jEnd;
+	for (size_t jj = 0; jj < jEnd; jj += stepJ)
+	{
+		const size_t j1 = std::min(jEnd, jj + stepJ);
+		for (size_t kk = 0; kk < kEnd; kk += stepK)
+		{
+			const size_t k1 = std::min(kEnd, kk + stepK);
+			for (size_t i = iBegin; i < iEnd; ++i)
+			{
+				T* ri = c + i * jEnd;
+				const T* ai = a + i * kEnd;
+				for (size_t k = kk; k < k1; ++k)
+				{
+					const T aik = ai[k];
+					const T* bk = b + k * jEnd;
+					for (size_t j = jj; j < j1; ++j)
+						ri[j] += aik * bk[j];
+				}
+			}
+		}
+	}
 }
 
+template <class T>
+inline void productRows(const matrix<T>& mat1, const matrix<T>& mat2, matrix<T>& res,
+	const size_t iBegin, const size_t iEnd, const size_t block)
+{
+	productRows(mat1.myVector.data(), mat2.myVector.data(), res.myVector.data(), mat1.cols(), mat2.cols(), iBegin, iEnd, block);
+}
 
 template <class T>
-matrix<T> matrixProductMT(const matrix<T>& mat1, const matrix<T>& mat2)
+matrix<T> matrixProductBlocked(const matrix<T>& mat1, const matrix<T>& mat2, const size_t block = 64)
 {
 	assert(mat1.cols() == mat2.rows());
 	matrix<T> res(mat1.rows(), mat2.cols());
+	productRows(mat1, mat2, res, 0, mat1.rows(), block);
+	return res;
+}
 
-	for (size_t i = 0; i < mat1.rows(); ++i)
-	{
-		for (size_t j = 0; j < mat2.cols(); ++j)
-			res[i][j] = 0;//init
-	}
+//  Bands of rows on num_threads threads, each band blocked if block > 0
+template <class T>
+matrix<T> matrixProductMT(const matrix<T>& mat1, const matrix<T>& mat2, const size_t num_threads = 4, const size_t block = 0)
+{
+	assert(mat1.cols() == mat2.rows() && num_threads > 0);
+	//  std::vector value-initializes, res is already zero
+	matrix<T> res(mat1.rows(), mat2.cols());
 
-	std::mutex mut;
-	int num_threads = 4;
+	adaptiveMutex mut; //held for one increment, spinning beats parking
 
-	int i_step = 0;
-	auto f_ =[&i_step, &mut, &res, mat1, mat2, num_threads]()
+	size_t i_step = 0;
+	auto f_ =[&i_step, &mut, &res, &mat1, &mat2, num_threads, block]() //by reference, a copy per thread is another full pass
 	{
 		mut.lock();
-		int i = i_step++; //post increment
+		size_t i = i_step++; //post increment
 		mut.unlock();
-		int i_start = mat1.rows() / num_threads * i;
-		int i_end = mat1.rows() / num_threads * (i+1);
-		for (i = i_start; i < i_end; ++i)
-		{
-			for (size_t k = 0; k < mat1.cols(); ++k)
-			{
-				//#pragma loop(no_vector) - cancel vectorization
-				for (size_t j = 0; j < mat2.cols(); ++j)
-					res[i][j] += mat1[i][k] * mat2[k][j];
-			}
-		}
-		
+		size_t i_start = mat1.rows() / num_threads * i;
+		size_t i_end = i == num_threads - 1 ? mat1.rows() : mat1.rows() / num_threads * (i+1); //last thread takes the remainder rows
+		productRows(mat1, mat2, res, i_start, i_end, block);
 	};
 
 	std::vector<std::thread> myThreads(num_threads);
-	for (int i = 0; i < num_threads; ++i)
+	for (size_t i = 0; i < num_threads; ++i)
 		myThreads[i] = std::thread(f_); //we pass reference
 
-	for (int i = 0; i < num_threads; ++i)
+	for (size_t i = 0; i < num_threads; ++i)
 		myThreads[i].join();
 
 	return res;//std::move 
 }
+
+//  c (B x B) += a * b, one tile each, row-major within
+//  B is a compile time constant, so the loops unroll and vectorize
+template <size_t B, class T>
+inline void tileProduct(const T* a, const T* b, T* c)
+{
+	for (size_t i = 0; i < B; ++i)
+	{
+		T* ci = c + i * B;
+		for (size_t k = 0; k < B; ++k)
+		{
+			const T aik = a[i * B + k];
+			const T* bk = b + k * B;
+			for (size_t j = 0; j < B; ++j) ci[j] += aik * bk[j];
+		}
+	}
+}
+
+//  Layout of the product of L1 and L2 matrices
+template <class L1, class L2> struct productLayout { typedef rowMajor type; };
+template <> struct productLayout<colMajor, colMajor> { typedef colMajor type; };
+template <size_t B> struct productLayout<tileMajor<B>, tileMajor<B>> { typedef tileMajor<B> type; };
+
+//  Products across layouts, each pairing runs the loop order that reads its operands
+//  contiguously (row-major pairs go through matrixProduct below)
+//  row x col: a dot product per element would be a reduction that does not vectorize,
+//  instead mat2 is packed row-major in one blocked pass, O(k*n) against O(m*k*n), then i-k-j
+//  col x row: i-k-j, one strided load of mat1 per k, the inner loop contiguous
+//  col x col: the storages are the transposes, C' = mat2' * mat1' in row-major, C comes out col-major
+//  tile x tile: tile by tile, three B x B tiles in cache at a time, C comes out tiled
+//  Other pairings convert to row-major first
+//  So do narrow types (accumulator_t<T> != T), to accumulate wide and saturate as the row-major
+//  products do, whatever the layouts
+template <class T, class L1, class L2>
+matrix<T, typename productLayout<L1, L2>::type> matrixProduct(const matrix<T, L1>& mat1, const matrix<T, L2>& mat2)
+{
+	assert(mat1.cols() == mat2.rows());
+	typedef typename productLayout<L1, L2>::type L;
+	constexpr bool row1 = std::is_same<L1, rowMajor>::value, col1 = std::is_same<L1, colMajor>::value;
+	constexpr bool row2 = std::is_same<L2, rowMajor>::value, col2 = std::is_same<L2, colMajor>::value;
+
+	if constexpr (!std::is_same<T, accumulator_t<T>>::value)
+	{
+		return matrix<T, L>(matrixProduct(matrix<T>(mat1), matrix<T>(mat2)));
+	}
+	else if constexpr (!(row1 && col2) && !(col1 && row2) && !(col1 && col2) && !isTileMajor<L>::value)
+	{
+		return matrixProduct(matrix<T>(mat1), matrix<T>(mat2));
+	}
+	else
+	{
+		const size_t m = mat1.rows(), K = mat1.cols(), n = mat2.cols();
+		matrix<T, L> res(m, n);
+
+		if constexpr (row1 && col2)
+		{
+			std::vector<T> packed(K * n);
+			transposeBlocked(mat2.myVector.data(), n, K, packed.data());
+			productRows(mat1.myVector.data(), packed.data(), res.myVector.data(), K, n, 0, m, 64);
+		}
+		else if constexpr (col1 && row2)
+		{
+			for (size_t i = 0; i < m; ++i)
+			{
+				T* ri = res[i];
+				for (size_t k = 0; k < K; ++k)
+				{
+					const T aik = mat1.myVector[k * m + i];
+					const T* bk = mat2[k];
+					for (size_t j = 0; j < n; ++j) ri[j] += aik * bk[j];
+				}
+			}
+		}
+		else if constexpr (col1 && col2)
+		{
+			productRows(mat2.myVector.data(), mat1.myVector.data(), res.myVector.data(), K, m, 0, n, 64);
+		}
+		else
+		{
+			const size_t B = L::tile;
+			for (size_t ti = 0; ti < L::tilesDown(m); ++ti)
+				for (size_t tj = 0; tj < L::tilesAcross(n); ++tj)
+				{
+					T* c = &res.myVector[L::tileOffset(ti, tj, n)];
+					for (size_t tk = 0; tk < L::tilesAcross(K); ++tk)
+						tileProduct<B>(&mat1.myVector[L::tileOffset(ti, tk, K)], &mat2.myVector[L::tileOffset(tk, tj, n)], c);
+				}
+		}
+
+		return res;
+	}
+}
+
+//  Defined in KernelTuner.h
+template <class T>
+matrix<T> matrixProductTuned(const matrix<T>& mat1, const matrix<T>& mat2);
+
+//  Runs the fastest kernel for this shape on this machine, per the tuning profile
+//  matrixProduct2 for types not tuned yet, see kernelTuner
+//  Narrow types (Acc != T) take the widening i-k-j kernel of matrixProduct2
+template <class T, class Acc = accumulator_t<T>>
+matrix<T> matrixProduct(const matrix<T>& mat1, const matrix<T>& mat2)
+{
+	if constexpr (std::is_same<T, Acc>::value) return matrixProductTuned(mat1, mat2);
+	else return matrixProduct2<T, Acc>(mat1, mat2);
+}